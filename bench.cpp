@@ -0,0 +1,425 @@
+#include "iso14443a-utils.h"
+#include "logger.h"
+#include "ntag2xx-emulation.h"
+#include "pn532-commands.h"
+#include "pn532-frame.h"
+#include "pn532-simulator.h"
+#include "pn532-transport.h"
+#include "pn532.h"
+#include "time-utils.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+// Keeps results alive so the measured calls are not optimized away
+static volatile uint32_t benchSink;
+
+static const uint64_t benchMinimumNanoseconds = 200 * 1000 * 1000;
+
+// Only benchmarks whose name starts with this run (./bench frame/)
+static const char *benchFilter = "";
+
+// Runs body in growing batches until the minimum run time is reached, returns ns/op
+template <typename Body>
+static double measure(Body body) {
+  uint64_t iterations = 1;
+  uint64_t elapsed = 0;
+
+  while (true) {
+    uint64_t start = monotonicNanoseconds();
+    for (uint64_t i = 0; i < iterations; i++) body();
+    elapsed = monotonicNanoseconds() - start;
+
+    if (elapsed >= benchMinimumNanoseconds) break;
+    iterations *= 2;
+  }
+
+  return (double)elapsed / iterations;
+}
+
+static bool selected(const char *name) {
+  return strncmp(name, benchFilter, strlen(benchFilter)) == 0;
+}
+
+static void report(const char *name, size_t bytesPerOp, double nanosecondsPerOp) {
+  double megabytesPerSecond = bytesPerOp * 1000.0 / nanosecondsPerOp;
+  printf("%-32s %6zu B %10.2f ns/op %10.1f MB/s\n", name, bytesPerOp, nanosecondsPerOp, megabytesPerSecond);
+}
+
+// Prints ns/op and MB/s for body, bytesPerOp being what one call processes
+template <typename Body>
+static void benchmark(const char *name, size_t bytesPerOp, Body body) {
+  if (!selected(name)) return;
+  report(name, bytesPerOp, measure(body));
+}
+
+// Sends stdout to /dev/null, returns what to pass to restoreStdout
+static int silenceStdout() {
+  fflush(stdout);
+  int savedStdout = dup(STDOUT_FILENO);
+  int devNull = open("/dev/null", O_WRONLY);
+  dup2(devNull, STDOUT_FILENO);
+  close(devNull);
+  return savedStdout;
+}
+
+static void restoreStdout(int savedStdout) {
+  fflush(stdout);
+  dup2(savedStdout, STDOUT_FILENO);
+  close(savedStdout);
+}
+
+// Same as benchmark, with stdout silenced while body runs, for the printing paths
+template <typename Body>
+static void benchmarkSilenced(const char *name, size_t bytesPerOp, Body body) {
+  if (!selected(name)) return;
+
+  int savedStdout = silenceStdout();
+  double nanosecondsPerOp = measure(body);
+  restoreStdout(savedStdout);
+
+  report(name, bytesPerOp, nanosecondsPerOp);
+}
+
+// Answers every frame written with the same ACK + response, straight from memory
+class ReplayTransport : public PN532Transport {
+public:
+  void setResponse(const uint8_t *response, size_t responseSize) {
+    static const uint8_t ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+    reply.assign(ack, ack + sizeof(ack));
+    reply.insert(reply.end(), response, response + responseSize);
+    position = reply.size();
+  }
+
+  int write(const uint8_t *data, size_t size) override {
+    position = 0;
+    return 0;
+  }
+
+  int read(uint8_t *buffer, size_t size) override {
+    size_t count = reply.size() - position < size ? reply.size() - position : size;
+    memcpy(buffer, reply.data() + position, count);
+    position += count;
+    return count;
+  }
+
+  int waitForInput(uint64_t deadline) override { return position < reply.size() ? 1 : -1; }
+  int setBaudRate(int baudRate) override { return 0; }
+  void drain() override {}
+  void flushInput() override {}
+  void close() override {}
+
+private:
+  std::vector<uint8_t> reply;
+  size_t position;
+};
+
+static void benchCRC() {
+  // Frame sizes seen in practice: SEL_REQ, READ response, FAST_READ response, NTAG215 dump
+  const size_t sizes[] = { 7, 18, 64, 262, 540 };
+  uint8_t data[540];
+  for (size_t i = 0; i < sizeof(data); i++) data[i] = rand();
+
+  char name[64];
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t size = sizes[i];
+
+    snprintf(name, sizeof(name), "crc_a/bytewise/%zu", size);
+    benchmark(name, size, [&] { benchSink += iso14443aCRCBytewise(data, size); });
+
+    snprintf(name, sizeof(name), "crc_a/slice8/%zu", size);
+    benchmark(name, size, [&] { benchSink += iso14443aCRC(data, size); });
+
+    snprintf(name, sizeof(name), "crc_a/constexpr-runtime/%zu", size);
+    benchmark(name, size, [&] { benchSink += iso14443aCRCConstexpr(data, size); });
+  }
+
+  // Fixed frame, folded at compile time: costs nothing but the copy
+  static constexpr uint8_t hlta[] = { 0x50, 0x00 };
+  benchmark("crc_a/compile-time-hlta", 2, [&] {
+    static constexpr auto hltaFrame = iso14443aFrameWithCRC(hlta);
+    benchSink += hltaFrame.bytes[2] | hltaFrame.bytes[3] << 8;
+  });
+}
+
+static void benchFrames() {
+  // Command data sizes: GetFirmwareVersion, READ response, largest normal frame, FAST_READ of 65 pages
+  const size_t sizes[] = { 1, 19, 253, 263 };
+  uint8_t data[263];
+  for (size_t i = 0; i < sizeof(data); i++) data[i] = rand();
+
+  uint8_t frame[PN532_MAX_FRAME_SIZE];
+  char name[64];
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t size = sizes[i];
+    size_t frameSize = pn532FrameSize(size);
+
+    snprintf(name, sizeof(name), "frame/encode/%zu", size);
+    benchmark(name, frameSize, [&] { benchSink += pn532EncodeFrame(0xD4, data, size, frame, sizeof(frame)); });
+
+    pn532EncodeFrame(0xD5, data, size, frame, sizeof(frame));
+    snprintf(name, sizeof(name), "frame/decode-header/%zu", size);
+    benchmark(name, frameSize, [&] {
+      PN532FrameHeader header;
+      benchSink += pn532DecodeFrameHeader(frame, frameSize, &header) + header.length;
+    });
+
+    // Full validation as readSerialFrame does it: start code, LCS and DCS
+    snprintf(name, sizeof(name), "frame/decode/%zu", size);
+    benchmark(name, frameSize, [&] {
+      PN532FrameDecoder decoder;
+      size_t used;
+      benchSink += decoder.feed(frame, frameSize, &used) + used;
+    });
+  }
+
+  // What ntag2xxReadPage does instead of encoding: copy a compile-time frame and patch the page
+  static constexpr auto readPageFrame = pn532CommandFrame<PN532::TxInDataExchange>({ 1, PN532::NTAG21xReadPage, 0 });
+  uint8_t page = 0;
+  benchmark("frame/prepared/read-page", readPageFrame.size(), [&] {
+    auto prepared = readPageFrame;
+    prepared.set(3, page++);
+    benchSink += prepared.bytes[prepared.size() - 2];
+  });
+
+  // Whole command round trip through PN532: sendFrame, then readSerialFrame
+  // for the ACK and the response, with the bytes coming straight from memory
+  const char *roundTrip = "frame/command-round-trip";
+  if (!selected(roundTrip) && strncmp(benchFilter, roundTrip, strlen(roundTrip)) != 0) return; // Skip the setup too
+
+  const uint8_t command[] = { PN532::TxGetFirmwareVersion };
+  uint8_t commandFrame[PN532_NORMAL_FRAME_OVERHEAD + 1 + sizeof(command)];
+  pn532EncodeFrame(0xD4, command, sizeof(command), commandFrame, sizeof(commandFrame));
+
+  ReplayTransport *transport = new ReplayTransport();
+  PN532 device(transport);
+  PN532Frame response;
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t size = sizes[i];
+    int responseSize = pn532EncodeFrame(0xD5, data, size, frame, sizeof(frame));
+    transport->setResponse(frame, responseSize);
+
+    snprintf(name, sizeof(name), "frame/command-round-trip/%zu", size);
+    benchmark(name, sizeof(commandFrame) + 6 + responseSize, [&] {
+      benchSink += device.sendEncodedCommand(commandFrame, sizeof(commandFrame), response, 10);
+    });
+  }
+}
+
+static void benchFormatting() {
+  uint8_t data[262];
+  for (size_t i = 0; i < sizeof(data); i++) data[i] = rand();
+
+  benchmarkSilenced("format/print-hex/16", 16, [&] { PN532::printHex(data, 16); });
+  benchmarkSilenced("format/print-hex/262", 262, [&] { PN532::printHex(data, 262); });
+
+  LogLevel = LogChannelFrame;
+  benchmarkSilenced("format/print-hex-log/16", 16, [&] { PN532::printHex(data, 16, LogChannelFrame); });
+  LogLevel = 0;
+
+  // InDataExchange with a READ response, and InListPassiveTarget with a 7-byte UID
+  uint8_t readResponse[2 + 16] = { PN532::RxInDataExchange, 0x00 };
+  memcpy(readResponse + 2, data, 16);
+  uint8_t readFrame[PN532_NORMAL_FRAME_OVERHEAD + 1 + sizeof(readResponse)];
+  pn532EncodeFrame(0xD5, readResponse, sizeof(readResponse), readFrame, sizeof(readFrame));
+  benchmarkSilenced("format/print-frame/read", sizeof(readFrame), [&] { PN532::printFrame(readFrame, sizeof(readFrame)); });
+
+  const uint8_t listResponse[] = { PN532::RxInListPassiveTarget, 1, 1, 0x00, 0x44, 0x00, 7, 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+  uint8_t listFrame[PN532_NORMAL_FRAME_OVERHEAD + 1 + sizeof(listResponse)];
+  pn532EncodeFrame(0xD5, listResponse, sizeof(listResponse), listFrame, sizeof(listFrame));
+  benchmarkSilenced("format/print-frame/list-target", sizeof(listFrame), [&] { PN532::printFrame(listFrame, sizeof(listFrame)); });
+}
+
+static void benchEmulator() {
+  const uint8_t uid[NTAG2XX_UID_SIZE] = { 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+  uint8_t pages[135 * 4]; // NTAG215
+  for (size_t i = 0; i < sizeof(pages); i++) pages[i] = rand();
+
+  NTAG2xxEmulator emulator;
+  emulator.load(uid, pages, 135);
+
+  // Commands as the PN532 hands them over with CRC off, so with their CRC_A
+  uint8_t read[4] = { PN532::NTAG21xReadPage, 0x04 };
+  iso14443aCRCAppend(read, sizeof(read));
+  uint8_t fastRead[5] = { PN532::NTAG21xFastRead, 0x00, 0x0F };
+  iso14443aCRCAppend(fastRead, sizeof(fastRead));
+  uint8_t getVersion[3] = { PN532::NTAG21xGetVersion };
+  iso14443aCRCAppend(getVersion, sizeof(getVersion));
+  uint8_t write[8] = { PN532::NTAG21xWritePage, 0x10, 0xDE, 0xAD, 0xBE, 0xEF };
+  iso14443aCRCAppend(write, sizeof(write));
+  const uint8_t wupa[] = { PN532::NTAG21xWakeUp };
+  const uint8_t anticollision[] = { PN532::NTAG21xSelectCL1, 0x20 };
+  const uint8_t unsupported[] = { 0xFF };
+
+  struct {
+    const char *name;
+    const uint8_t *command;
+    size_t commandSize;
+  } commands[] = {
+    { "emulator/read", read, sizeof(read) },
+    { "emulator/fast-read-16", fastRead, sizeof(fastRead) },
+    { "emulator/get-version", getVersion, sizeof(getVersion) },
+    { "emulator/write", write, sizeof(write) },
+    { "emulator/wupa", wupa, sizeof(wupa) },
+    { "emulator/anticollision-cl1", anticollision, sizeof(anticollision) },
+    { "emulator/unsupported", unsupported, sizeof(unsupported) },
+  };
+
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    NTAG2xxResponse response;
+
+    // WUPA resets the session, so every command runs against an active tag
+    emulator.handleCommand(wupa, sizeof(wupa), &response);
+    emulator.handleCommand(commands[i].command, commands[i].commandSize, &response);
+    size_t responseSize = response.frameSize;
+
+    benchmark(commands[i].name, responseSize, [&] {
+      emulator.handleCommand(commands[i].command, commands[i].commandSize, &response);
+      benchSink += response.frameSize;
+    });
+  }
+}
+
+static std::vector<uint8_t> withCRC(std::initializer_list<uint8_t> bytes) {
+  std::vector<uint8_t> frame(bytes);
+  frame.resize(frame.size() + 2);
+  iso14443aCRCAppend(frame.data(), frame.size());
+  return frame;
+}
+
+// A phone reading the whole tag, as the PN532 passes it on with CRC off: WUPA,
+// both cascade levels of anticollision and SELECT, GET_VERSION, a READ for
+// every fourth page (each returns four) and HLTA
+static std::vector<std::vector<uint8_t>> phoneReadSession(const uint8_t *uid, int pageCount) {
+  const uint8_t level1[5] = { 0x88, uid[0], uid[1], uid[2], (uint8_t)(0x88 ^ uid[0] ^ uid[1] ^ uid[2]) };
+  const uint8_t level2[5] = { uid[3], uid[4], uid[5], uid[6], (uint8_t)(uid[3] ^ uid[4] ^ uid[5] ^ uid[6]) };
+
+  std::vector<std::vector<uint8_t>> session;
+  session.push_back({ PN532::NTAG21xWakeUp });
+  session.push_back({ PN532::NTAG21xSelectCL1, 0x20 });
+  session.push_back(withCRC({ PN532::NTAG21xSelectCL1, 0x70, level1[0], level1[1], level1[2], level1[3], level1[4] }));
+  session.push_back({ PN532::NTAG21xSelectCL2, 0x20 });
+  session.push_back(withCRC({ PN532::NTAG21xSelectCL2, 0x70, level2[0], level2[1], level2[2], level2[3], level2[4] }));
+  session.push_back(withCRC({ PN532::NTAG21xGetVersion }));
+  for (int page = 0; page < pageCount; page += 4) session.push_back(withCRC({ PN532::NTAG21xReadPage, (uint8_t)page }));
+  session.push_back(withCRC({ PN532::NTAG21xHalt, 0x00 }));
+
+  return session;
+}
+
+static const char *opcodeName(uint8_t opcode) {
+  switch (opcode) {
+  case PN532::NTAG21xWakeUp: return "WUPA";
+  case PN532::NTAG21xSelectCL1: return "SELECT CL1";
+  case PN532::NTAG21xSelectCL2: return "SELECT CL2";
+  case PN532::NTAG21xGetVersion: return "GET_VERSION";
+  case PN532::NTAG21xReadPage: return "READ";
+  default: return "?";
+  }
+}
+
+// ntag2xxEmulate answering back-to-back phone sessions from PN532Simulator.
+// No wire and no RF, so this is everything the host spends per session: frame
+// parsing, dispatch, register cache, encoding. Latencies run from the
+// simulator handing out an initiator command to the answer coming back
+static void benchSessions() {
+  const struct {
+    const char *name;
+    int pageCount;
+  } tags[] = {
+    { "session/ntag213", 45 },
+    { "session/ntag215", 135 },
+    { "session/ntag216", 231 },
+  };
+  const int sessions = 2000;
+
+  const uint8_t uid[NTAG2XX_UID_SIZE] = { 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+  uint8_t pages[NTAG2XX_MAX_PAGES * 4];
+  for (size_t i = 0; i < sizeof(pages); i++) pages[i] = rand();
+
+  for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+    if (!selected(tags[i].name)) continue;
+
+    NTAG2xxEmulator emulator;
+    emulator.load(uid, pages, tags[i].pageCount);
+
+    std::vector<std::vector<uint8_t>> session = phoneReadSession(uid, tags[i].pageCount);
+    PN532Simulator simulator;
+    simulator.setAwake(true);
+    simulator.setInitiatorScript(session, sessions);
+
+    std::vector<PN532Simulator::TargetExchange> exchanges;
+    exchanges.reserve(session.size() * sessions);
+    simulator.setExchangeLog(&exchanges);
+
+    // Runs until the script is used up and the simulator stops answering
+    int savedStdout = silenceStdout();
+    uint64_t start = monotonicNanoseconds();
+    {
+      PN532 device(new PN532MemoryTransport(&simulator));
+      device.ntag2xxEmulate(emulator);
+    }
+    uint64_t elapsed = monotonicNanoseconds() - start;
+    restoreStdout(savedStdout);
+
+    // Every command but HLTA is answered
+    size_t expected = (session.size() - 1) * sessions;
+    if (exchanges.size() != expected) {
+      printf("%s: %zu of %zu commands answered\n", tags[i].name, exchanges.size(), expected);
+      continue;
+    }
+
+    size_t bytesRead = (tags[i].pageCount + 3) / 4 * 16;
+    double nanosecondsPerSession = (double)elapsed / sessions;
+    report(tags[i].name, bytesRead, nanosecondsPerSession);
+    printf("  %.0f sessions/s, %zu commands each\n", 1e9 / nanosecondsPerSession, session.size());
+
+    // Exact percentiles per opcode, the histograms in EmulationLatencyStats start at microseconds
+    printf("  %-12s %8s %10s %10s %10s %10s\n", "command", "count", "p50 (ns)", "p90 (ns)", "p99 (ns)", "max (ns)");
+    const uint8_t opcodes[] = { PN532::NTAG21xWakeUp, PN532::NTAG21xSelectCL1, PN532::NTAG21xSelectCL2, PN532::NTAG21xGetVersion, PN532::NTAG21xReadPage };
+    for (size_t o = 0; o < sizeof(opcodes) / sizeof(opcodes[0]); o++) {
+      std::vector<uint64_t> latencies;
+      for (size_t e = 0; e < exchanges.size(); e++) {
+        if (exchanges[e].opcode == opcodes[o]) latencies.push_back(exchanges[e].nanoseconds);
+      }
+      if (latencies.empty()) continue;
+
+      std::sort(latencies.begin(), latencies.end());
+      size_t count = latencies.size();
+      printf("  %-12s %8zu %10llu %10llu %10llu %10llu\n", opcodeName(opcodes[o]), count,
+        (unsigned long long)latencies[count / 2], (unsigned long long)latencies[count * 9 / 10],
+        (unsigned long long)latencies[count * 99 / 100], (unsigned long long)latencies[count - 1]);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  srand(1);
+  if (argc > 1) benchFilter = argv[1];
+
+  // Sanity check before timing anything
+  uint8_t data[540];
+  for (size_t i = 0; i < sizeof(data); i++) data[i] = rand();
+  for (size_t size = 0; size <= sizeof(data); size++) {
+    if (iso14443aCRC(data, size) != iso14443aCRCBytewise(data, size)) {
+      printf("CRC_A mismatch at %zu bytes\n", size);
+      return -1;
+    }
+  }
+
+  benchCRC();
+  benchFrames();
+  benchFormatting();
+  benchEmulator();
+  benchSessions();
+
+  return 0;
+}
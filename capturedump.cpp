@@ -0,0 +1,32 @@
+#include "frame-capture.h"
+#include "pn532.h"
+
+#include <stdio.h>
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    printf("Usage: %s <capture file>\n", argv[0]);
+    return -1;
+  }
+
+  FrameCaptureReader reader;
+  if (reader.open(argv[1]) < 0) return -1;
+
+  const FrameCaptureRecord *record;
+  const uint8_t *frame;
+  uint64_t firstTimestamp = 0;
+  int count = 0;
+
+  while (reader.next(&record, &frame)) {
+    if (!count) firstTimestamp = record->timestamp;
+    count++;
+
+    printf("\n[%d] +%.3f ms %s (%d bytes)\n", count, (record->timestamp - firstTimestamp) / 1000000.0,
+           record->direction == FrameCaptureHostToPN532 ? "Host -> PN532" : "PN532 -> Host", record->length);
+    PN532::printHex(frame, record->length);
+    PN532::printFrame(frame, record->length);
+  }
+
+  printf("\n%d frames\n", count);
+  return 0;
+}
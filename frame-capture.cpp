@@ -0,0 +1,148 @@
+#include "frame-capture.h"
+#include "time-utils.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static size_t paddingFor(size_t length) {
+  return (8 - (length % 8)) % 8; // Keep every record header 8-byte aligned
+}
+
+FrameCapture::FrameCapture() : fd(-1) {}
+
+FrameCapture::~FrameCapture() {
+  close();
+}
+
+int FrameCapture::open(const char *path) {
+  close();
+
+  fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    printf("Could not open capture file %s\n", path);
+    return -1;
+  }
+
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) < 0) {
+    close();
+    return -1;
+  }
+
+  if (fileStat.st_size == 0) {
+    FrameCaptureFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FRAME_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = FRAME_CAPTURE_VERSION;
+    header.headerSize = sizeof(header);
+
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+      printf("Could not write capture header\n");
+      close();
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void FrameCapture::close() {
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+void FrameCapture::record(FrameCaptureDirection direction, const uint8_t *frame, size_t size) {
+  if (fd < 0) return;
+
+  FrameCaptureRecord record;
+  memset(&record, 0, sizeof(record));
+  record.timestamp = monotonicNanoseconds();
+  record.direction = direction;
+  record.length = size;
+
+  static const uint8_t padding[8] = { 0 };
+
+  // One write per record, so concurrent or crashing writers never leave half a record behind another
+  struct iovec parts[3] = {
+    { &record, sizeof(record) },
+    { (void *)frame, size },
+    { (void *)padding, paddingFor(size) },
+  };
+
+  if (writev(fd, parts, 3) < 0) {
+    printf("Capture write failed, disabling capture\n");
+    close();
+  }
+}
+
+FrameCaptureReader::FrameCaptureReader() : data(NULL), size(0), offset(0) {}
+
+FrameCaptureReader::~FrameCaptureReader() {
+  close();
+}
+
+int FrameCaptureReader::open(const char *path) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("Could not open capture file %s\n", path);
+    return -1;
+  }
+
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) < 0 || (size_t)fileStat.st_size < sizeof(FrameCaptureFileHeader)) {
+    printf("Capture file too short\n");
+    ::close(fd);
+    return -1;
+  }
+
+  void *mapping = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    printf("Could not map capture file\n");
+    return -1;
+  }
+
+  data = (const uint8_t *)mapping;
+  size = fileStat.st_size;
+
+  const FrameCaptureFileHeader *header = (const FrameCaptureFileHeader *)data;
+  if (memcmp(header->magic, FRAME_CAPTURE_MAGIC, sizeof(header->magic)) || header->version != FRAME_CAPTURE_VERSION) {
+    printf("Not a version %d capture file\n", FRAME_CAPTURE_VERSION);
+    close();
+    return -1;
+  }
+
+  offset = header->headerSize;
+  return 0;
+}
+
+void FrameCaptureReader::close() {
+  if (data) {
+    munmap((void *)data, size);
+    data = NULL;
+  }
+  size = 0;
+  offset = 0;
+}
+
+bool FrameCaptureReader::next(const FrameCaptureRecord **record, const uint8_t **frame) {
+  if (!data || offset + sizeof(FrameCaptureRecord) > size) return false;
+
+  const FrameCaptureRecord *nextRecord = (const FrameCaptureRecord *)(data + offset);
+  if (offset + sizeof(FrameCaptureRecord) + nextRecord->length > size) return false;
+
+  *record = nextRecord;
+  *frame = data + offset + sizeof(FrameCaptureRecord);
+  offset += sizeof(FrameCaptureRecord) + nextRecord->length + paddingFor(nextRecord->length);
+
+  return true;
+}
@@ -0,0 +1,77 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+// Binary capture of host <-> PN532 traffic, for leaving on in production.
+// Records are appended with a single write each, so everything up to a crash
+// is on disk, and nothing is formatted until the capture is decoded offline.
+//
+// File layout (host byte order, fixed-size headers so the file can be mmapped):
+//   FrameCaptureFileHeader
+//   FrameCaptureRecord, frame bytes, padding to 8 bytes
+//   FrameCaptureRecord, frame bytes, padding to 8 bytes
+//   ...
+
+#define FRAME_CAPTURE_MAGIC "PN532CAP"
+#define FRAME_CAPTURE_VERSION 1
+
+enum FrameCaptureDirection {
+  FrameCaptureHostToPN532 = 0,
+  FrameCapturePN532ToHost = 1,
+};
+
+struct FrameCaptureFileHeader {
+  char magic[8]; // FRAME_CAPTURE_MAGIC, not null terminated
+  uint16_t version;
+  uint16_t headerSize; // sizeof(FrameCaptureFileHeader)
+  uint32_t reserved;
+};
+
+struct FrameCaptureRecord {
+  uint64_t timestamp; // Monotonic nanoseconds
+  uint8_t direction; // FrameCaptureDirection
+  uint8_t reserved;
+  uint16_t length; // Frame bytes that follow this header
+  uint32_t reserved2;
+};
+
+class FrameCapture {
+public:
+  FrameCapture();
+  ~FrameCapture();
+
+  // Appends to path, writing the file header if the file is new
+  int open(const char *path);
+  void close();
+  bool isOpen() const { return fd >= 0; }
+
+  void record(FrameCaptureDirection direction, const uint8_t *frame, size_t size);
+
+private:
+  int fd;
+};
+
+// Read-only view of a capture file, mapped into memory
+class FrameCaptureReader {
+public:
+  FrameCaptureReader();
+  ~FrameCaptureReader();
+
+  int open(const char *path);
+  void close();
+
+  // Walks records in order. Returns false at the end of the file or on a truncated record
+  bool next(const FrameCaptureRecord **record, const uint8_t **frame);
+
+private:
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+};
+
+#endif
@@ -0,0 +1,151 @@
+#include "iso14443a-anticollision.h"
+#include "ntag2xx-emulation.h"
+#include "pn532-simulator.h"
+#include "pn532-transport.h"
+#include "pn532.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Anticollision against several emulated tags behind PN532Simulator, through
+// the real PN532 command path: make test
+
+static int failures = 0;
+
+#define CHECK(condition)                                              \
+  do {                                                                \
+    if (!(condition)) {                                               \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+static const int pageCount = 45; // NTAG213
+
+// A and B differ in cascade level 1, A and C only in the last bit of level 2
+static const uint8_t uids[][NTAG2XX_UID_SIZE] = {
+  { 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 },
+  { 0x04, 0x11, 0xA2, 0x33, 0x44, 0x55, 0x77 },
+  { 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0xE6 },
+};
+static const int uidCount = sizeof(uids) / sizeof(uids[0]);
+
+static bool found(const Iso14443aTarget *targets, int targetCount, const uint8_t *uid) {
+  for (int i = 0; i < targetCount; i++) {
+    if (targets[i].uidSize == NTAG2XX_UID_SIZE && memcmp(targets[i].uid, uid, NTAG2XX_UID_SIZE) == 0) return true;
+  }
+  return false;
+}
+
+// Enumerates the first tagCount tags of uids, each found exactly once
+static void testEnumerate(int tagCount) {
+  uint8_t pages[pageCount * 4];
+  memset(pages, 0, sizeof(pages));
+
+  NTAG2xxEmulator tags[uidCount];
+  PN532Simulator simulator;
+  simulator.setAwake(true);
+  for (int i = 0; i < tagCount; i++) {
+    CHECK(tags[i].load(uids[i], pages, pageCount) == 0);
+    simulator.addTag(&tags[i]);
+  }
+
+  PN532 device(new PN532MemoryTransport(&simulator));
+  PN532Iso14443aTransceiver transceiver(&device);
+  Iso14443aAnticollision anticollision(&transceiver);
+
+  Iso14443aTarget targets[4];
+  int targetCount = anticollision.enumerate(targets, 4);
+  CHECK(targetCount == tagCount);
+  if (targetCount != tagCount) return;
+
+  for (int i = 0; i < tagCount; i++) {
+    CHECK(found(targets, targetCount, uids[i]));
+    CHECK(targets[i].sak == 0x00);
+  }
+
+  // All halted now, so a plain REQA finds nobody
+  Iso14443aTarget target;
+  CHECK(anticollision.selectOne(&target) == 0);
+
+  // And WUPA brings them all back
+  CHECK(anticollision.enumerate(targets, 4) == tagCount);
+}
+
+// selectOne with two tags answering: resolves the collisions and selects one
+static void testSelectOne() {
+  uint8_t pages[pageCount * 4];
+  memset(pages, 0, sizeof(pages));
+
+  NTAG2xxEmulator tags[2];
+  PN532Simulator simulator;
+  simulator.setAwake(true);
+  for (int i = 0; i < 2; i++) {
+    CHECK(tags[i].load(uids[i], pages, pageCount) == 0);
+    simulator.addTag(&tags[i]);
+  }
+
+  PN532 device(new PN532MemoryTransport(&simulator));
+  PN532Iso14443aTransceiver transceiver(&device);
+  Iso14443aAnticollision anticollision(&transceiver);
+
+  Iso14443aTarget target;
+  CHECK(anticollision.selectOne(&target) == 1);
+  CHECK(found(&target, 1, uids[0]) || found(&target, 1, uids[1]));
+}
+
+// The collision position as the CIU reports it, read back by transceiveBitsInitiator
+static void testCollisionPosition() {
+  uint8_t pages[pageCount * 4];
+  memset(pages, 0, sizeof(pages));
+
+  NTAG2xxEmulator tags[2];
+  PN532Simulator simulator;
+  simulator.setAwake(true);
+  for (int i = 0; i < 2; i++) {
+    CHECK(tags[i].load(uids[i], pages, pageCount) == 0);
+    simulator.addTag(&tags[i]);
+  }
+
+  PN532 device(new PN532MemoryTransport(&simulator));
+  uint8_t rx[5];
+  int collisionBit;
+
+  const uint8_t wupa = PN532::NTAG21xWakeUp;
+  CHECK(device.transceiveBitsInitiator(&wupa, 7, 0, rx, sizeof(rx), &collisionBit) == 2);
+  CHECK(collisionBit == -1); // Same ATQA from both
+
+  // Cascade tag, 04 11, then 22 against A2: the last bit of the fourth byte,
+  // which CollPos reports as 0 (= 32)
+  const uint8_t anticollision[] = { PN532::NTAG21xSelectCL1, 0x20 };
+  CHECK(device.transceiveBitsInitiator(anticollision, 16, 0, rx, sizeof(rx), &collisionBit) == 5);
+  CHECK(collisionBit == 31);
+  CHECK(rx[0] == 0x88 && rx[1] == 0x04 && rx[2] == 0x11);
+  CHECK(simulator.registerValue(PN532::RegisterCIU_Error) & 0x08); // CollErr
+  CHECK(simulator.registerValue(PN532::RegisterCIU_Coll) == 0x80);
+
+  // Knowing 31 bits plus a 0 leaves only A, starting at bit 0 of the fifth byte
+  const uint8_t partial[] = { PN532::NTAG21xSelectCL1, 0x60, 0x88, 0x04, 0x11, 0x22 };
+  CHECK(device.transceiveBitsInitiator(partial, 48, 0, rx, sizeof(rx), &collisionBit) == 1);
+  CHECK(collisionBit == -1);
+  CHECK(rx[0] == (0x88 ^ 0x04 ^ 0x11 ^ 0x22)); // BCC
+
+  // Mid-byte: 28 bits known, both tags answer from bit 4 of the fourth byte
+  const uint8_t midByte[] = { PN532::NTAG21xSelectCL1, 0x54, 0x88, 0x04, 0x11, 0x02 };
+  CHECK(device.transceiveBitsInitiator(midByte, 44, 4, rx, sizeof(rx), &collisionBit) == 2);
+  CHECK(collisionBit == 7); // Bit 31 of the UID part, counted from bit 0 of rx[0]
+}
+
+int main() {
+  for (int tagCount = 0; tagCount <= uidCount; tagCount++) testEnumerate(tagCount);
+  testSelectOne();
+  testCollisionPosition();
+
+  if (failures) {
+    printf("iso14443a-anticollision-test: %d failures\n", failures);
+    return 1;
+  }
+
+  printf("iso14443a-anticollision-test: OK\n");
+  return 0;
+}
@@ -0,0 +1,188 @@
+#include "iso14443a-anticollision.h"
+#include "iso14443a-utils.h"
+
+#include <string.h>
+
+#define ISO14443A_REQA 0x26
+#define ISO14443A_WUPA 0x52
+#define ISO14443A_CASCADE_TAG 0x88
+#define ISO14443A_SAK_CASCADE 0x04 // UID not complete yet
+
+static const uint8_t selectCodes[3] = { 0x93, 0x95, 0x97 }; // Cascade level 1-3
+
+static constexpr uint8_t hlta[] = { 0x50, 0x00 };
+static constexpr auto hltaWithCRC = iso14443aFrameWithCRC(hlta);
+
+// Keeps bits 0-bit of part, zeroes the rest
+static void clearBitsAfter(uint8_t *part, int bit) {
+  int byte = bit / 8;
+  part[byte] &= (1 << (bit % 8 + 1)) - 1;
+  memset(part + byte + 1, 0, 5 - byte - 1);
+}
+
+Iso14443aAnticollision::Iso14443aAnticollision(Iso14443aTransceiver *transceiver) : transceiver(transceiver) {
+  exchanges = 0;
+}
+
+int Iso14443aAnticollision::transceive(const uint8_t *tx, size_t txBits, uint8_t rxAlign, uint8_t *rx, size_t rxSize, int *collisionBit) {
+  exchanges++;
+  return transceiver->transceive(tx, txBits, rxAlign, rx, rxSize, collisionBit);
+}
+
+int Iso14443aAnticollision::request(uint8_t command, uint8_t *atqa) {
+  uint8_t rx[2] = {};
+  int collisionBit;
+
+  // Short frame: 7 bits. ATQA bits collide harmlessly when several tags answer
+  int received = transceive(&command, 7, 0, rx, sizeof(rx), &collisionBit);
+  if (received <= 0) return received;
+
+  memcpy(atqa, rx, 2);
+  return 1;
+}
+
+int Iso14443aAnticollision::selectLevel(int level, const uint8_t *part, uint8_t *sak) {
+  uint8_t tx[9] = { selectCodes[level], 0x70 }; // NVB 0x70 = all 40 bits
+  memcpy(tx + 2, part, 5);
+  iso14443aCRCAppend(tx, sizeof(tx));
+
+  uint8_t rx[3];
+  int collisionBit;
+  int received = transceive(tx, sizeof(tx) * 8, 0, rx, sizeof(rx), &collisionBit);
+  if (received <= 0) return received;
+
+  if (received != 3 || collisionBit >= 0 || !iso14443aCRCCheck(rx, 3)) return -1;
+
+  *sak = rx[0];
+  return 1;
+}
+
+int Iso14443aAnticollision::halt() {
+  uint8_t rx[1];
+  int collisionBit;
+
+  // A halted tag stays silent, an answer would be a NAK
+  return transceive(hltaWithCRC.bytes, hltaWithCRC.size() * 8, 0, rx, sizeof(rx), &collisionBit) < 0 ? -1 : 0;
+}
+
+int Iso14443aAnticollision::resolve(Branch branch, Iso14443aTarget *target, std::vector<Branch> *pending) {
+  uint8_t sak = 0;
+
+  // Levels settled before the fork this branch starts from
+  for (int level = 0; level < branch.level; level++) {
+    int result = selectLevel(level, branch.parts[level], &sak);
+    if (result <= 0) return result;
+    if (!(sak & ISO14443A_SAK_CASCADE)) return -1;
+  }
+
+  for (int level = branch.level; level < 3; level++) {
+    uint8_t *part = branch.parts[level];
+    int knownBits = level == branch.level ? branch.knownBits : 0;
+
+    while (knownBits < 40) {
+      // NVB: whole bytes known (including SEL and NVB) in the high nibble, extra bits in the low one
+      uint8_t tx[7] = { selectCodes[level], (uint8_t)(((2 + knownBits / 8) << 4) | (knownBits % 8)) };
+      memcpy(tx + 2, part, (knownBits + 7) / 8);
+
+      // Tags answer with the rest of the UID part, starting mid-byte when knownBits is not whole bytes
+      uint8_t rxAlign = knownBits % 8;
+      uint8_t rx[5] = {};
+      int collisionBit;
+      int received = transceive(tx, 16 + knownBits, rxAlign, rx, sizeof(rx), &collisionBit);
+      if (received <= 0) return received;
+
+      int firstByte = knownBits / 8;
+      uint8_t keepMask = (1 << rxAlign) - 1;
+      part[firstByte] = (part[firstByte] & keepMask) | (rx[0] & ~keepMask);
+      for (int i = 1; i < received && firstByte + i < 5; i++) part[firstByte + i] = rx[i];
+
+      if (collisionBit < 0) {
+        if (firstByte + received < 5) return -1; // Cut short
+        knownBits = 40;
+        break;
+      }
+
+      int bit = firstByte * 8 + collisionBit;
+      if (bit < knownBits || bit >= 40) return -1;
+
+      // Come back for the tags with a 0 here, carry on with the ones with a 1
+      clearBitsAfter(part, bit);
+      Branch other = branch;
+      other.level = level;
+      other.parts[level][bit / 8] &= ~(1 << (bit % 8));
+      other.knownBits = bit + 1;
+      pending->push_back(other);
+
+      part[bit / 8] |= 1 << (bit % 8);
+      knownBits = bit + 1;
+    }
+
+    if ((part[0] ^ part[1] ^ part[2] ^ part[3]) != part[4]) return -1; // BCC
+
+    int result = selectLevel(level, part, &sak);
+    if (result <= 0) return result;
+
+    if (sak & ISO14443A_SAK_CASCADE) {
+      if (part[0] != ISO14443A_CASCADE_TAG) return -1;
+      continue;
+    }
+
+    // Cascade tag + 3 UID bytes for every level but the last, which holds 4
+    target->sak = sak;
+    target->uidSize = 0;
+    for (int done = 0; done < level; done++) {
+      memcpy(target->uid + target->uidSize, branch.parts[done] + 1, 3);
+      target->uidSize += 3;
+    }
+    memcpy(target->uid + target->uidSize, part, 4);
+    target->uidSize += 4;
+    return 1;
+  }
+
+  return -1; // Still cascading after level 3
+}
+
+int Iso14443aAnticollision::selectOne(Iso14443aTarget *target) {
+  exchanges = 0;
+
+  int present = request(ISO14443A_REQA, target->atqa);
+  if (present <= 0) return present;
+
+  Branch root = {};
+  std::vector<Branch> pending;
+  return resolve(root, target, &pending);
+}
+
+int Iso14443aAnticollision::enumerate(Iso14443aTarget *targets, int maxTargets) {
+  exchanges = 0;
+
+  std::vector<Branch> pending;
+  Branch root = {};
+  pending.push_back(root);
+
+  int found = 0;
+  bool first = true;
+  while (!pending.empty() && found < maxTargets) {
+    Branch branch = pending.back();
+    pending.pop_back();
+
+    // Every tag we have not halted yet is back in IDLE after the last SELECT
+    uint8_t atqa[2];
+    int present = request(first ? ISO14443A_WUPA : ISO14443A_REQA, atqa);
+    first = false;
+    if (present < 0) return -1;
+    if (!present) break; // Nobody left in the field
+
+    // 0 = the tags on this branch left the field, move on to the next one
+    int resolved = resolve(branch, &targets[found], &pending);
+    if (resolved < 0) return -1;
+    if (!resolved) continue;
+
+    memcpy(targets[found].atqa, atqa, 2);
+    found++;
+
+    if (halt() < 0) return -1;
+  }
+
+  return found;
+}
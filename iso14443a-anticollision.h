@@ -0,0 +1,79 @@
+#ifndef ISO14443A_ANTICOLLISION_H
+#define ISO14443A_ANTICOLLISION_H
+
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+#include <vector>
+
+#define ISO14443A_MAX_UID_SIZE 10
+
+// Sends raw Type A frames and hands back what came over the air. Parity is
+// the transceiver's business, CRC_A is not: frames go out exactly as given
+class Iso14443aTransceiver {
+public:
+  virtual ~Iso14443aTransceiver() {}
+
+  // Sends the first txBits bits of tx, LSB first. The answer is stored with
+  // its first bit at bit rxAlign of rx[0]. Returns the number of bytes stored
+  // (0 = no answer, < 0 = error) and sets collisionBit to the index of the
+  // first collided bit in rx, counting from bit 0 of rx[0], or -1
+  virtual int transceive(const uint8_t *tx, size_t txBits, uint8_t rxAlign, uint8_t *rx, size_t rxSize, int *collisionBit) = 0;
+};
+
+// One activated tag
+struct Iso14443aTarget {
+  uint8_t atqa[2]; // As received. Several tags answering at once may blend
+  uint8_t sak; // Final SAK
+  uint8_t uid[ISO14443A_MAX_UID_SIZE];
+  uint8_t uidSize; // 4, 7 or 10
+};
+
+// ISO/IEC 14443-3 anticollision and selection for single, double and triple
+// size UIDs, with any number of tags in the field.
+//
+// Every bit collision is a fork in a binary tree of UIDs. We follow the 1
+// branch straight away and remember the prefix of the 0 branch, so once a tag
+// is selected and halted the next one is found by jumping to a remembered
+// prefix instead of starting the anticollision loop over. Each tag costs its
+// request, one anticollision round per fork plus one per cascade level, one
+// SELECT per cascade level and the HLTA
+class Iso14443aAnticollision {
+public:
+  Iso14443aAnticollision(Iso14443aTransceiver *transceiver);
+
+  // Activates one tag and leaves it selected. Returns 1, 0 if no tag
+  // answered, or -1 on a protocol error
+  int selectOne(Iso14443aTarget *target);
+  // Activates and halts every tag in the field (WUPA first, so tags halted
+  // earlier are included). Returns how many were found, at most maxTargets,
+  // or -1 on a transceiver or protocol error
+  int enumerate(Iso14443aTarget *targets, int maxTargets);
+
+  // Raw exchanges used by the last selectOne or enumerate
+  int exchangeCount() const { return exchanges; }
+
+private:
+  // Where to pick up resolving a UID: cascade levels done so far, plus the
+  // known leading bits of the current level's UID part
+  struct Branch {
+    uint8_t parts[3][5]; // UID part + BCC for each cascade level
+    int level;
+    int knownBits; // Of parts[level], 0-40
+  };
+
+  int transceive(const uint8_t *tx, size_t txBits, uint8_t rxAlign, uint8_t *rx, size_t rxSize, int *collisionBit);
+  int request(uint8_t command, uint8_t *atqa);
+  int selectLevel(int level, const uint8_t *part, uint8_t *sak);
+  int halt();
+  // Resolves one tag from branch, pushing the branches not taken onto pending
+  int resolve(Branch branch, Iso14443aTarget *target, std::vector<Branch> *pending);
+
+  Iso14443aTransceiver *transceiver;
+  int exchanges;
+};
+
+#endif
@@ -2,16 +2,73 @@
 
 #include <stdio.h>
 
-uint16_t iso14443aCRC(const uint8_t *pbtData, size_t szLen) {
+// Vectors from ISO/IEC 14443-3 Annex B
+static constexpr uint8_t crcVector1[] = { 0x00, 0x00 };
+static constexpr uint8_t crcVector2[] = { 0x12, 0x34 };
+static_assert(iso14443aCRCConstexpr(crcVector1, 2) == 0x1EA0, "CRC_A of 00 00 must be A0 1E");
+static_assert(iso14443aCRCConstexpr(crcVector2, 2) == 0xCF26, "CRC_A of 12 34 must be 26 CF");
+
+struct CRCTables {
+  // table[k][b]: CRC contribution of byte b followed by k zero bytes
+  uint16_t table[8][256];
+};
+
+static constexpr CRCTables makeCRCTables() {
+  CRCTables tables = {};
+
+  for (int b = 0; b < 256; b++) {
+    uint16_t crc = b;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1; // 0x8408 = x^16 + x^12 + x^5 + 1, reflected
+    }
+    tables.table[0][b] = crc;
+  }
+
+  for (int k = 1; k < 8; k++) {
+    for (int b = 0; b < 256; b++) {
+      uint16_t previous = tables.table[k - 1][b];
+      tables.table[k][b] = (previous >> 8) ^ tables.table[0][previous & 0xFF];
+    }
+  }
+
+  return tables;
+}
+
+static constexpr CRCTables crcTables = makeCRCTables();
+
+uint16_t iso14443aCRC(const uint8_t *data, size_t dataSize) {
+  const uint16_t (*table)[256] = crcTables.table;
+  uint16_t crc = 0x6363;
+
+  // Slicing-by-8: fold the CRC into the first two bytes, then look up all eight independently
+  while (dataSize >= 8) {
+    uint16_t x = crc ^ (data[0] | (data[1] << 8));
+    crc = table[7][x & 0xFF] ^ table[6][x >> 8]
+      ^ table[5][data[2]] ^ table[4][data[3]]
+      ^ table[3][data[4]] ^ table[2][data[5]]
+      ^ table[1][data[6]] ^ table[0][data[7]];
+
+    data += 8;
+    dataSize -= 8;
+  }
+
+  while (dataSize--) {
+    crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF];
+  }
+
+  return crc;
+}
+
+uint16_t iso14443aCRCBytewise(const uint8_t *pbtData, size_t szLen) {
   uint32_t wCrc = 0x6363;
 
-  do {
+  while (szLen--) {
     uint8_t  bt;
     bt = *pbtData++;
     bt = (bt ^ (uint8_t)(wCrc & 0x00FF));
     bt = (bt ^ (bt << 4));
     wCrc = (wCrc >> 8) ^ ((uint32_t) bt << 8) ^ ((uint32_t) bt << 3) ^ ((uint32_t) bt >> 4);
-  } while (--szLen);
+  }
 
   return (uint16_t)wCrc;
 }
@@ -19,5 +76,14 @@ uint16_t iso14443aCRC(const uint8_t *pbtData, size_t szLen) {
 void iso14443aCRCAppend(uint8_t *pbtData, size_t szLen) {
   uint16_t crc = iso14443aCRC(pbtData, szLen - 2);
 
-  *(uint16_t *)(pbtData + szLen - 2) = crc;
+  // CRC_A goes out LSB first
+  pbtData[szLen - 2] = crc & 0xFF;
+  pbtData[szLen - 1] = crc >> 8;
+}
+
+bool iso14443aCRCCheck(const uint8_t *frame, size_t frameSize) {
+  if (frameSize < 2) return false;
+
+  // Running the CRC over data + its own CRC leaves no remainder
+  return iso14443aCRC(frame, frameSize) == 0;
 }
@@ -1,8 +1,51 @@
+#ifndef ISO14443A_UTILS_H
+#define ISO14443A_UTILS_H
+
 #include <stdlib.h>
 
 #ifdef linux
 #include <stdint.h>
 #endif
 
+// CRC_A (ISO/IEC 14443-3 Annex B), table driven, 8 bytes per step
 uint16_t iso14443aCRC(const uint8_t *data, size_t dataSize);
+// Original shift-per-byte implementation, kept as the reference for iso14443aCRC
+uint16_t iso14443aCRCBytewise(const uint8_t *data, size_t dataSize);
+// Writes the CRC of the first dataSize - 2 bytes into the last two bytes (LSB first)
 void iso14443aCRCAppend(uint8_t *data, size_t dataSize);
+// True if the last two bytes of a received frame are a valid CRC_A of the rest
+bool iso14443aCRCCheck(const uint8_t *frame, size_t frameSize);
+
+// Byte-at-a-time CRC_A usable in constant expressions, for frames known at compile time
+constexpr uint16_t iso14443aCRCConstexpr(const uint8_t *data, size_t dataSize) {
+  uint16_t crc = 0x6363;
+  for (size_t i = 0; i < dataSize; i++) {
+    uint8_t bt = data[i] ^ (uint8_t)(crc & 0x00FF);
+    bt = (bt ^ (uint8_t)(bt << 4));
+    crc = (crc >> 8) ^ ((uint16_t)bt << 8) ^ ((uint16_t)bt << 3) ^ ((uint16_t)bt >> 4);
+  }
+  return crc;
+}
+
+template <size_t N>
+struct Iso14443aFrame {
+  uint8_t bytes[N + 2];
+
+  constexpr size_t size() const { return N + 2; }
+};
+
+// data followed by its CRC_A, built at compile time:
+//   static constexpr uint8_t hlta[] = { 0x50, 0x00 };
+//   static constexpr auto hltaFrame = iso14443aFrameWithCRC(hlta); // 50 00 57 CD
+template <size_t N>
+constexpr Iso14443aFrame<N> iso14443aFrameWithCRC(const uint8_t (&data)[N]) {
+  Iso14443aFrame<N> frame = {};
+  for (size_t i = 0; i < N; i++) frame.bytes[i] = data[i];
+
+  uint16_t crc = iso14443aCRCConstexpr(data, N);
+  frame.bytes[N] = crc & 0xFF;
+  frame.bytes[N + 1] = crc >> 8;
+  return frame;
+}
+
+#endif
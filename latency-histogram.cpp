@@ -0,0 +1,107 @@
+#include "latency-histogram.h"
+
+#include <stdio.h>
+#include <string.h>
+
+LatencyHistogram::LatencyHistogram() {
+  clear();
+}
+
+void LatencyHistogram::clear() {
+  memset(buckets, 0, sizeof(buckets));
+  samples = 0;
+  maximum = 0;
+}
+
+int LatencyHistogram::bucketForMicroseconds(uint64_t microseconds) {
+  if (microseconds < 4) return microseconds;
+
+  int exponent = 63 - __builtin_clzll(microseconds); // >= 2
+  int step = (microseconds >> (exponent - 2)) & 3;
+  int bucket = (exponent - 1) * 4 + step;
+
+  return bucket < bucketCount ? bucket : bucketCount - 1;
+}
+
+uint64_t LatencyHistogram::bucketUpperBoundMicroseconds(int bucket) {
+  if (bucket < 4) return bucket + 1;
+
+  int exponent = bucket / 4 + 1;
+  int step = bucket % 4;
+  return ((uint64_t)(4 + step + 1)) << (exponent - 2);
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds) {
+  buckets[bucketForMicroseconds(nanoseconds / 1000)]++;
+  samples++;
+  if (nanoseconds > maximum) maximum = nanoseconds;
+}
+
+uint64_t LatencyHistogram::percentileNanoseconds(double fraction) const {
+  if (!samples) return 0;
+
+  uint64_t target = (uint64_t)(fraction * samples + 0.5);
+  if (target < 1) target = 1;
+
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < bucketCount; bucket++) {
+    seen += buckets[bucket];
+    if (seen >= target) {
+      uint64_t bound = bucketUpperBoundMicroseconds(bucket) * 1000;
+      return bound < maximum ? bound : maximum;
+    }
+  }
+
+  return maximum;
+}
+
+EmulationLatencyStats::EmulationLatencyStats() {
+  memset(opcodes, 0, sizeof(opcodes));
+  printRequested = 0;
+}
+
+EmulationLatencyStats::~EmulationLatencyStats() {
+  for (int i = 0; i < 256; i++) delete[] opcodes[i];
+}
+
+void EmulationLatencyStats::record(uint8_t opcode, uint64_t received, uint64_t dispatched, uint64_t written, uint64_t acked) {
+  if (!opcodes[opcode]) opcodes[opcode] = new LatencyHistogram[PhaseCount];
+
+  LatencyHistogram *phases = opcodes[opcode];
+  phases[PhaseDispatch].record(dispatched - received);
+  phases[PhaseWrite].record(written - dispatched);
+  phases[PhaseAck].record(acked - written);
+  phases[PhaseTotal].record(acked - received);
+}
+
+void EmulationLatencyStats::clear() {
+  for (int i = 0; i < 256; i++) {
+    if (!opcodes[i]) continue;
+    for (int phase = 0; phase < PhaseCount; phase++) opcodes[i][phase].clear();
+  }
+}
+
+void EmulationLatencyStats::print() const {
+  static const char *phaseNames[PhaseCount] = { "dispatch", "write", "ack", "total" };
+
+  printf("Opcode  Phase      Count    p50 (us)    p99 (us)    max (us)\n");
+  for (int i = 0; i < 256; i++) {
+    if (!opcodes[i] || !opcodes[i][PhaseTotal].count()) continue;
+
+    for (int phase = 0; phase < PhaseCount; phase++) {
+      const LatencyHistogram &histogram = opcodes[i][phase];
+      printf("%02X      %-8s %7llu %11.1f %11.1f %11.1f\n", i, phaseNames[phase],
+             (unsigned long long)histogram.count(),
+             histogram.percentileNanoseconds(0.5) / 1000.0,
+             histogram.percentileNanoseconds(0.99) / 1000.0,
+             histogram.maxNanoseconds() / 1000.0);
+    }
+  }
+}
+
+void EmulationLatencyStats::printIfRequested() {
+  if (!printRequested) return;
+
+  printRequested = 0;
+  print();
+}
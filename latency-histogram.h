@@ -0,0 +1,66 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <signal.h>
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+// Fixed-bucket latency histogram. Buckets are log2 of microseconds split into
+// 4 linear steps, so every bucket is within 25% of its value from 4 us to
+// over an hour. Recording is a few instructions and never allocates
+class LatencyHistogram {
+public:
+  static const int bucketCount = 128;
+
+  LatencyHistogram();
+
+  void record(uint64_t nanoseconds);
+  void clear();
+
+  uint64_t count() const { return samples; }
+  uint64_t maxNanoseconds() const { return maximum; }
+  // Upper bound of the bucket holding the given fraction (0-1) of samples
+  uint64_t percentileNanoseconds(double fraction) const;
+
+private:
+  static int bucketForMicroseconds(uint64_t microseconds);
+  static uint64_t bucketUpperBoundMicroseconds(int bucket);
+
+  uint32_t buckets[bucketCount];
+  uint64_t samples;
+  uint64_t maximum;
+};
+
+// Per-opcode timing of the emulation loop, for each phase of answering one
+// initiator command
+class EmulationLatencyStats {
+public:
+  enum Phase {
+    PhaseDispatch, // Initiator command received -> response chosen
+    PhaseWrite, // Response chosen -> TgResponseToInitiator written
+    PhaseAck, // Written -> PN532 ACK received
+    PhaseTotal, // Initiator command received -> ACK
+    PhaseCount,
+  };
+
+  EmulationLatencyStats();
+  ~EmulationLatencyStats();
+
+  // Timestamps in monotonic nanoseconds
+  void record(uint8_t opcode, uint64_t received, uint64_t dispatched, uint64_t written, uint64_t acked);
+  void clear();
+  void print() const;
+
+  // Safe to call from a signal handler, the emulation loop prints between commands
+  void requestPrint() { printRequested = 1; }
+  void printIfRequested();
+
+private:
+  LatencyHistogram *opcodes[256]; // Allocated on first use of each opcode, PhaseCount each
+  volatile sig_atomic_t printRequested;
+};
+
+#endif
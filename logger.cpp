@@ -10,6 +10,19 @@ void log(LogChannel channel, const char *format...) {
   switch (channel) {
   case LogChannelSerial:
     printf("Serial:\t");
+    break;
+
+  case LogChannelCommand:
+    printf("Command:\t");
+    break;
+
+  case LogChannelFrame:
+    printf("Frame:\t");
+    break;
+
+  case LogChannelEmulation:
+    printf("Emulation:\t");
+    break;
   }
 
   va_list args;
@@ -2,11 +2,34 @@
 #define LOGGER_H
 #include <cstdarg>
 
-extern int LogLevel;
+extern int LogLevel; // Bitmask of enabled LogChannels
 
 enum LogChannel {
-  LogChannelSerial = 1 << 0,
+  LogChannelSerial = 1 << 0, // Raw serial I/O
+  LogChannelCommand = 1 << 1, // Commands, ACKs and responses
+  LogChannelFrame = 1 << 2, // Hex dumps and decoded frames
+  LogChannelEmulation = 1 << 3, // Tag emulation
 };
 
+enum LogSeverity {
+  LogSeverityTrace = 0, // Per-byte/per-frame detail
+  LogSeverityDebug, // Per-command progress
+  LogSeverityInfo, // Setup and session progress
+};
+
+// Messages less severe than this are removed at compile time: no formatting,
+// and their arguments are never evaluated. Build with
+// -DLOG_MIN_SEVERITY=LogSeverityTrace (make DEBUG=1) to keep everything
+#ifndef LOG_MIN_SEVERITY
+#define LOG_MIN_SEVERITY LogSeverityInfo
+#endif
+
+#define LOG_ENABLED(severity, channel) ((severity) >= LOG_MIN_SEVERITY && (LogLevel & (channel)))
+
+#define LOG(severity, channel, ...) do { if (LOG_ENABLED(severity, channel)) log(channel, __VA_ARGS__); } while (0)
+#define LOG_TRACE(channel, ...) LOG(LogSeverityTrace, channel, __VA_ARGS__)
+#define LOG_DEBUG(channel, ...) LOG(LogSeverityDebug, channel, __VA_ARGS__)
+#define LOG_INFO(channel, ...) LOG(LogSeverityInfo, channel, __VA_ARGS__)
+
 void log(LogChannel channel, const char *format...);
 #endif
@@ -0,0 +1,427 @@
+#include "ntag2xx-emulation.h"
+#include "iso14443a-utils.h"
+#include "logger.h"
+#include "pn532.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void ntag2xxBuildReadFrame(const uint8_t *pages, int pageCount, int page, uint8_t *frame) {
+  uint8_t command[19] = { PN532::TxTgResponseToInitiator };
+  for (int i = 0; i < 4; i++) {
+    memcpy(command + 1 + i * 4, pages + ((page + i) % pageCount) * 4, 4);
+  }
+  iso14443aCRCAppend(command + 1, 18);
+
+  pn532EncodeFrame(0xD4, command, sizeof(command), frame, NTAG2XX_READ_FRAME_SIZE);
+}
+
+void ntag2xxDefaultVersion(int pageCount, uint8_t *version) {
+  // Vendor NXP, NTAG, 50 pF, 1.0, storage size closest to the image, ISO 14443-3
+  uint8_t storageSize = pageCount <= 45 ? 0x0F : pageCount <= 135 ? 0x11 : 0x13;
+  const uint8_t defaultVersion[NTAG2XX_VERSION_SIZE] = { 0x00, 0x04, 0x04, 0x02, 0x01, 0x00, storageSize, 0x03 };
+  memcpy(version, defaultVersion, sizeof(defaultVersion));
+}
+
+NTAG2xxImageStorage::NTAG2xxImageStorage() {
+  loaded = false;
+  pageCopy = NULL;
+  frames = NULL;
+  frameTable = NULL;
+}
+
+NTAG2xxImageStorage::~NTAG2xxImageStorage() {
+  delete[] pageCopy;
+  delete[] frames;
+  delete[] frameTable;
+}
+
+int NTAG2xxImageStorage::buildFrames(const uint8_t *pages, int pageCount) {
+  if (pageCount < 1 || pageCount > NTAG2XX_MAX_PAGES) {
+    printf("Invalid page count for emulation: %d\n", pageCount);
+    return -1;
+  }
+
+  delete[] frames;
+  delete[] frameTable;
+  frames = new uint8_t[pageCount * NTAG2XX_READ_FRAME_SIZE];
+  frameTable = new const uint8_t *[pageCount];
+
+  for (int page = 0; page < pageCount; page++) {
+    ntag2xxBuildReadFrame(pages, pageCount, page, frames + page * NTAG2XX_READ_FRAME_SIZE);
+    frameTable[page] = frames + page * NTAG2XX_READ_FRAME_SIZE;
+  }
+
+  prepared.pageCount = pageCount;
+  prepared.pages = pages;
+  prepared.readFrames = frameTable;
+  return 0;
+}
+
+int NTAG2xxImageStorage::load(const uint8_t *uid, const uint8_t *data, int pageCount) {
+  loaded = false;
+  if (pageCount < 1 || pageCount > NTAG2XX_MAX_PAGES) {
+    printf("Invalid page count for emulation: %d\n", pageCount);
+    return -1;
+  }
+
+  delete[] pageCopy;
+  pageCopy = new uint8_t[pageCount * 4];
+  memcpy(pageCopy, data, pageCount * 4);
+  if (buildFrames(pageCopy, pageCount) < 0) return -1;
+
+  memcpy(prepared.uid, uid, NTAG2XX_UID_SIZE);
+  prepared.atqa[0] = 0x44;
+  prepared.atqa[1] = 0x00;
+  prepared.sak = 0x00;
+  ntag2xxDefaultVersion(pageCount, prepared.version);
+  memset(prepared.signature, 0, sizeof(prepared.signature)); // READ_SIG answers with zeros
+
+  loaded = true;
+  return 0;
+}
+
+int NTAG2xxImageStorage::load(const TagImage &image) {
+  loaded = false;
+  if (!image.isValid() || image.uidSize() != NTAG2XX_UID_SIZE) {
+    printf("Not an NTAG21x image\n");
+    return -1;
+  }
+
+  if (buildFrames(image.pages(), image.pageCount()) < 0) return -1;
+
+  memcpy(prepared.uid, image.uid(), NTAG2XX_UID_SIZE);
+  memcpy(prepared.atqa, image.atqa(), 2);
+  prepared.sak = image.sak();
+  if (image.version()) memcpy(prepared.version, image.version(), NTAG2XX_VERSION_SIZE);
+  else ntag2xxDefaultVersion(image.pageCount(), prepared.version);
+  memcpy(prepared.signature, image.signature(), NTAG2XX_SIGNATURE_SIZE);
+
+  loaded = true;
+  return 0;
+}
+
+static constexpr uint8_t ntag2xxAck = 0x0A;
+static constexpr uint8_t ntag2xxNakInvalid = 0x00;
+static constexpr uint8_t ntag2xxNakCRC = 0x01;
+
+// SAK with the cascade bit, CRC_A folded in at compile time. The final SAK comes from the image
+static constexpr uint8_t sakCascade[] = { 0x04 };
+static constexpr auto sakCascadeWithCRC = iso14443aFrameWithCRC(sakCascade);
+
+constexpr NTAG2xxEmulator::CommandTable NTAG2xxEmulator::buildCommandTable() {
+  CommandTable table = {};
+
+  table.entries[PN532::NTAG21xRequest] = { &NTAG2xxEmulator::handleRequest, 1, false };
+  table.entries[PN532::NTAG21xWakeUp] = { &NTAG2xxEmulator::handleRequest, 1, false };
+  table.entries[PN532::NTAG21xSelectCL1] = { &NTAG2xxEmulator::handleSelect, 0, false };
+  table.entries[PN532::NTAG21xSelectCL2] = { &NTAG2xxEmulator::handleSelect, 0, false };
+  table.entries[PN532::NTAG21xReadPage] = { &NTAG2xxEmulator::handleRead, 2, true };
+  table.entries[PN532::NTAG21xFastRead] = { &NTAG2xxEmulator::handleFastRead, 3, true };
+  table.entries[PN532::NTAG21xGetVersion] = { &NTAG2xxEmulator::handleGetVersion, 1, true };
+  table.entries[PN532::NTAG21xReadSignature] = { &NTAG2xxEmulator::handleReadSignature, 2, true };
+  table.entries[PN532::NTAG21xPasswordAuth] = { &NTAG2xxEmulator::handlePasswordAuth, 5, true };
+  table.entries[PN532::NTAG21xReadCounter] = { &NTAG2xxEmulator::handleReadCounter, 2, true };
+  table.entries[PN532::NTAG21xWritePage] = { &NTAG2xxEmulator::handleWrite, 6, true };
+  table.entries[PN532::NTAG21xCompatibilityWrite] = { &NTAG2xxEmulator::handleCompatibilityWrite, 2, true };
+  table.entries[PN532::NTAG21xHalt] = { &NTAG2xxEmulator::handleHalt, 2, true };
+
+  return table;
+}
+
+const NTAG2xxEmulator::CommandTable NTAG2xxEmulator::commandTable = NTAG2xxEmulator::buildCommandTable();
+
+NTAG2xxEmulator::NTAG2xxEmulator() : pendingImage(NULL) {
+  image = NULL;
+  readCounter = 0;
+
+  prepare(&ackFrame, &ntag2xxAck, 1, false);
+  prepare(&nakInvalidFrame, &ntag2xxNakInvalid, 1, false);
+  prepare(&nakCRCFrame, &ntag2xxNakCRC, 1, false);
+  prepare(&sakCascadeFrame, sakCascadeWithCRC.bytes, sakCascadeWithCRC.size(), false);
+
+  reset();
+}
+
+int NTAG2xxEmulator::load(const uint8_t *uid, const uint8_t *data, int pageCount) {
+  if (ownImage.load(uid, data, pageCount) < 0) return -1;
+
+  return load(ownImage.image());
+}
+
+int NTAG2xxEmulator::load(const TagImage &image) {
+  if (ownImage.load(image) < 0) return -1;
+
+  return load(ownImage.image());
+}
+
+int NTAG2xxEmulator::load(const NTAG2xxImage *newImage) {
+  if (!newImage) return -1;
+
+  pendingImage.store(NULL);
+  applyImage(newImage);
+  reset();
+  return 0;
+}
+
+void NTAG2xxEmulator::switchImage(const NTAG2xxImage *newImage) {
+  pendingImage.store(newImage, std::memory_order_release);
+}
+
+void NTAG2xxEmulator::applyImage(const NTAG2xxImage *newImage) {
+  image = newImage;
+
+  // Only the page copy and frame pointers scale with the image, the frames themselves are shared
+  memcpy(pages, image->pages, image->pageCount * 4);
+  memcpy(readFrames, image->readFrames, image->pageCount * sizeof(readFrames[0]));
+
+  // Anticollision answers: cascade tag 0x88 + first three UID bytes, then the last four, each with BCC
+  const uint8_t *uid = image->uid;
+  const uint8_t cascadeUids[2][4] = { { 0x88, uid[0], uid[1], uid[2] }, { uid[3], uid[4], uid[5], uid[6] } };
+  for (int level = 0; level < 2; level++) {
+    memcpy(cascadeLevels[level], cascadeUids[level], 4);
+    cascadeLevels[level][4] = cascadeUids[level][0] ^ cascadeUids[level][1] ^ cascadeUids[level][2] ^ cascadeUids[level][3];
+  }
+  prepare(&cascadeLevel1Frame, cascadeLevels[0], 5, false);
+  prepare(&cascadeLevel2Frame, cascadeLevels[1], 5, false);
+
+  prepare(&atqaFrame, image->atqa, 2, false);
+  prepare(&sakFrame, &image->sak, 1, true);
+  prepare(&versionFrame, image->version, NTAG2XX_VERSION_SIZE, true);
+  prepare(&signatureFrame, image->signature, NTAG2XX_SIGNATURE_SIZE, true);
+
+  // PACK lives in the first two bytes of the last page, writePage rebuilds
+  // it. Dumps cannot read back the password, so every PWD_AUTH is accepted
+  prepare(&packFrame, pages + (image->pageCount - 1) * 4, 2, true);
+
+  readCounter = 0;
+}
+
+void NTAG2xxEmulator::reset() {
+  const NTAG2xxImage *pending = pendingImage.exchange(NULL, std::memory_order_acquire);
+  if (pending) {
+    applyImage(pending);
+    LOG_DEBUG(LogChannelEmulation, "Switched image\n");
+  }
+
+  state = StateIdle;
+  compatibilityWritePage = 0;
+  readCounted = false;
+}
+
+void NTAG2xxEmulator::handleCommand(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  response->frame = NULL;
+  response->frameSize = 0;
+  response->bitsInLastByte = 0;
+
+  if (commandSize == 0) return;
+
+  if (!image) {
+    reset(); // Nothing to serve until an image has been switched in
+    if (!image) return;
+  }
+
+  if (state == StateCompatibilityWrite) {
+    // Second half of COMP_WRITE: 16 bytes, of which the first page is written
+    state = StateActive;
+    if (commandSize == 18 && !iso14443aCRCCheck(command, commandSize)) return respond(response, nakCRCFrame, 4);
+    if (commandSize != 16 && commandSize != 18) return respond(response, nakInvalidFrame, 4);
+
+    if (writePage(compatibilityWritePage, command) < 0) return respond(response, nakInvalidFrame, 4);
+    return respond(response, ackFrame, 4);
+  }
+
+  const CommandEntry &entry = commandTable.entries[command[0]];
+
+  if (state == StateHalted && command[0] != PN532::NTAG21xWakeUp) {
+    LOG_DEBUG(LogChannelEmulation, "Halted, ignoring %X\n", command[0]);
+    return;
+  }
+
+  if (!entry.handler) {
+    LOG_DEBUG(LogChannelEmulation, "Unsupported command: %X\n", command[0]);
+    return respond(response, nakInvalidFrame, 4);
+  }
+
+  // Strip the CRC_A when the PN532 passed it through
+  if (entry.size == 0) {
+    if (commandSize >= 3 && iso14443aCRCCheck(command, commandSize)) commandSize -= 2;
+  } else if (entry.hasCRC && commandSize == entry.size + 2u) {
+    if (!iso14443aCRCCheck(command, commandSize)) {
+      LOG_DEBUG(LogChannelEmulation, "CRC error on %X\n", command[0]);
+      return respond(response, nakCRCFrame, 4);
+    }
+    commandSize -= 2;
+  } else if (commandSize != entry.size) {
+    LOG_DEBUG(LogChannelEmulation, "Bad length %d for %X\n", (int)commandSize, command[0]);
+    return respond(response, nakInvalidFrame, 4);
+  }
+
+  (this->*entry.handler)(command, commandSize, response);
+}
+
+void NTAG2xxEmulator::handleRequest(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  LOG_DEBUG(LogChannelEmulation, "Got %s, replying with ATQA\n", command[0] == PN532::NTAG21xWakeUp ? "WUPA" : "REQA");
+  reset();
+
+  respond(response, atqaFrame);
+}
+
+void NTAG2xxEmulator::handleSelect(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  bool cascadeLevel1 = command[0] == PN532::NTAG21xSelectCL1;
+
+  if (commandSize == 2 && command[1] == 0x20) { // ANTICOLLISION, NVB = whole UID part requested
+    return respond(response, cascadeLevel1 ? cascadeLevel1Frame : cascadeLevel2Frame);
+  }
+
+  if (commandSize == 7 && command[1] == 0x70) { // SELECT with the full UID part + BCC
+    if (memcmp(command + 2, cascadeLevels[cascadeLevel1 ? 0 : 1], 5) != 0) return; // Someone else is being selected
+
+    if (cascadeLevel1) return respond(response, sakCascadeFrame);
+
+    LOG_DEBUG(LogChannelEmulation, "Selected\n");
+    state = StateActive;
+    return respond(response, sakFrame);
+  }
+
+  // Partial-bit anticollision only matters with several tags in the field
+  LOG_DEBUG(LogChannelEmulation, "Unsupported select: %d bytes\n", (int)commandSize);
+}
+
+void NTAG2xxEmulator::handleRead(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  uint8_t page = command[1];
+  LOG_DEBUG(LogChannelEmulation, "Sending page: %X\n", page);
+
+  if (page >= pageCount()) return respond(response, nakInvalidFrame, 4);
+
+  response->frame = readFrames[page];
+  response->frameSize = NTAG2XX_READ_FRAME_SIZE;
+  response->bitsInLastByte = 0;
+  countRead();
+}
+
+void NTAG2xxEmulator::handleFastRead(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  int startPage = command[1];
+  int endPage = command[2];
+  LOG_DEBUG(LogChannelEmulation, "Fast read: %X-%X\n", startPage, endPage);
+
+  // No wrap for FAST_READ; the PN532 caps how much fits in one response
+  if (startPage > endPage || endPage >= pageCount() || endPage - startPage + 1 > NTAG2XX_MAX_FAST_READ_PAGES) {
+    return respond(response, nakInvalidFrame, 4);
+  }
+
+  respondWith(response, pages + startPage * 4, (endPage - startPage + 1) * 4);
+  countRead();
+}
+
+void NTAG2xxEmulator::handleGetVersion(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  LOG_DEBUG(LogChannelEmulation, "Get version\n");
+  respond(response, versionFrame);
+}
+
+void NTAG2xxEmulator::handleReadSignature(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  LOG_DEBUG(LogChannelEmulation, "Read signature\n");
+  respond(response, signatureFrame);
+}
+
+void NTAG2xxEmulator::handlePasswordAuth(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  LOG_DEBUG(LogChannelEmulation, "Password auth\n");
+  respond(response, packFrame);
+}
+
+void NTAG2xxEmulator::handleReadCounter(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  if (command[1] != 0x02) return respond(response, nakInvalidFrame, 4); // Only the NFC counter exists
+
+  const uint8_t counter[] = { (uint8_t)readCounter, (uint8_t)(readCounter >> 8), (uint8_t)(readCounter >> 16) };
+  respondWith(response, counter, sizeof(counter));
+}
+
+void NTAG2xxEmulator::handleWrite(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  LOG_DEBUG(LogChannelEmulation, "Write page: %X\n", command[1]);
+  if (writePage(command[1], command + 2) < 0) return respond(response, nakInvalidFrame, 4);
+
+  respond(response, ackFrame, 4);
+}
+
+void NTAG2xxEmulator::handleCompatibilityWrite(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  LOG_DEBUG(LogChannelEmulation, "Compatibility write page: %X\n", command[1]);
+  if (command[1] < 2 || command[1] >= pageCount()) return respond(response, nakInvalidFrame, 4);
+
+  compatibilityWritePage = command[1];
+  state = StateCompatibilityWrite;
+  respond(response, ackFrame, 4);
+}
+
+void NTAG2xxEmulator::handleHalt(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response) {
+  LOG_DEBUG(LogChannelEmulation, "Halting\n");
+  state = StateHalted; // HLTA is never answered
+}
+
+int NTAG2xxEmulator::writePage(uint8_t page, const uint8_t *bytes) {
+  if (page < 2 || page >= pageCount()) return -1; // UID pages are read only
+
+  uint8_t *target = pages + page * 4;
+  switch (page) {
+  case 2: // Serial number byte and internal byte stay, lock bytes can only be set
+    target[2] |= bytes[2];
+    target[3] |= bytes[3];
+    break;
+
+  case 3: // OTP bits can only be set
+    for (int i = 0; i < 4; i++) target[i] |= bytes[i];
+    break;
+
+  default: // Lock bits are not enforced
+    memcpy(target, bytes, 4);
+    break;
+  }
+
+  // Frames starting up to 3 pages earlier (wrapping) include this page. They
+  // move to our own copies so the shared image frames stay untouched
+  int count = pageCount();
+  for (int i = 0; i < 4 && i < count; i++) {
+    int start = (page - i + count) % count;
+    ntag2xxBuildReadFrame(pages, count, start, writtenFrames[start]);
+    readFrames[start] = writtenFrames[start];
+  }
+
+  // PACK is answered from a prepared frame, keep it in step with the page
+  if (page == count - 1) prepare(&packFrame, target, 2, true);
+  return 0;
+}
+
+void NTAG2xxEmulator::countRead() {
+  if (readCounted) return;
+
+  readCounted = true;
+  if (readCounter < 0xFFFFFF) readCounter++;
+}
+
+void NTAG2xxEmulator::prepare(PreparedFrame *frame, const uint8_t *data, size_t dataSize, bool appendCRC) {
+  uint8_t command[2 + NTAG2XX_SIGNATURE_SIZE + 2] = { PN532::TxTgResponseToInitiator };
+  memcpy(command + 1, data, dataSize);
+
+  size_t commandSize = dataSize + 1;
+  if (appendCRC) {
+    commandSize += 2;
+    iso14443aCRCAppend(command + 1, dataSize + 2);
+  }
+
+  frame->size = pn532EncodeFrame(0xD4, command, commandSize, frame->bytes, sizeof(frame->bytes));
+}
+
+void NTAG2xxEmulator::respond(NTAG2xxResponse *response, const PreparedFrame &frame, uint8_t bitsInLastByte) {
+  response->frame = frame.bytes;
+  response->frameSize = frame.size;
+  response->bitsInLastByte = bitsInLastByte;
+}
+
+void NTAG2xxEmulator::respondWith(NTAG2xxResponse *response, const uint8_t *data, size_t dataSize) {
+  uint8_t command[1 + NTAG2XX_MAX_FAST_READ_PAGES * 4 + 2] = { PN532::TxTgResponseToInitiator };
+  memcpy(command + 1, data, dataSize);
+  iso14443aCRCAppend(command + 1, dataSize + 2);
+
+  response->frame = scratchFrame;
+  response->frameSize = pn532EncodeFrame(0xD4, command, dataSize + 3, scratchFrame, sizeof(scratchFrame));
+  response->bitsInLastByte = 0;
+}
@@ -0,0 +1,185 @@
+#ifndef NTAG2XX_EMULATION_H
+#define NTAG2XX_EMULATION_H
+
+#include "pn532-frame.h"
+#include "tag-image.h"
+
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+#include <atomic>
+
+#define NTAG2XX_UID_SIZE 7
+#define NTAG2XX_SIGNATURE_SIZE 32
+#define NTAG2XX_VERSION_SIZE 8
+#define NTAG2XX_MAX_PAGES 256 // READ addresses pages with one byte
+#define NTAG2XX_MAX_FAST_READ_PAGES 65 // 260 bytes + CRC_A fills a 262 byte TgResponseToInitiator
+// TFI + TgResponseToInitiator + 16 bytes of page data + CRC_A
+#define NTAG2XX_READ_FRAME_SIZE (PN532_NORMAL_FRAME_OVERHEAD + 2 + 16 + 2)
+
+// Builds the host-to-PN532 TgResponseToInitiator frame answering READ at page:
+// four pages, wrapping past the last page back to page 0 like a real tag
+void ntag2xxBuildReadFrame(const uint8_t *pages, int pageCount, int page, uint8_t *frame);
+// GET_VERSION bytes of the NTAG21x whose memory is closest to pageCount
+void ntag2xxDefaultVersion(int pageCount, uint8_t *version);
+
+// Everything the emulator needs to serve one tag, with every READ response
+// already framed and checksummed. Read-only once built, so images can be
+// shared between emulators, deduplicated (see TagLibrary) and switched
+// between without rebuilding anything
+struct NTAG2xxImage {
+  uint8_t uid[NTAG2XX_UID_SIZE];
+  uint8_t atqa[2]; // As sent, LSB first
+  uint8_t sak; // Final SAK, after cascade level 2
+  uint8_t version[NTAG2XX_VERSION_SIZE];
+  uint8_t signature[NTAG2XX_SIGNATURE_SIZE];
+  int pageCount; // 1-256
+  const uint8_t *pages; // pageCount 4-byte pages
+  const uint8_t *const *readFrames; // NTAG2XX_READ_FRAME_SIZE bytes for each start page
+};
+
+// A single NTAG2xxImage and the frames it points at
+class NTAG2xxImageStorage {
+public:
+  NTAG2xxImageStorage();
+  ~NTAG2xxImageStorage();
+
+  // uid is NTAG2XX_UID_SIZE bytes, data holds pageCount 4-byte pages (copied)
+  int load(const uint8_t *uid, const uint8_t *data, int pageCount);
+  // Also takes the image's ATQA/SAK, version and signature. Pages are used in
+  // place, so the archive must stay open
+  int load(const TagImage &image);
+
+  // NULL until something is loaded
+  const NTAG2xxImage *image() const { return loaded ? &prepared : NULL; }
+
+private:
+  int buildFrames(const uint8_t *pages, int pageCount);
+
+  NTAG2xxImage prepared;
+  bool loaded;
+  uint8_t *pageCopy;
+  uint8_t *frames; // pageCount * NTAG2XX_READ_FRAME_SIZE
+  const uint8_t **frameTable;
+};
+
+// What to send back for one initiator command
+struct NTAG2xxResponse {
+  const uint8_t *frame; // Complete TgResponseToInitiator frame, NULL = stay silent
+  size_t frameSize;
+  uint8_t bitsInLastByte; // 4 for ACK/NAK, 0 = whole bytes
+};
+
+// NTAG213/215/216 command set, independent of the PN532 it is answering through.
+// Commands are dispatched through a 256 entry opcode table and answered from
+// frames prepared ahead of time wherever the answer only depends on the image
+class NTAG2xxEmulator {
+public:
+  NTAG2xxEmulator();
+
+  // Builds a private image and serves it
+  int load(const uint8_t *uid, const uint8_t *data, int pageCount);
+  int load(const TagImage &image);
+  // Serves a prepared image from now on. The image is not copied and must
+  // outlive its use. Only call from the thread running handleCommand
+  int load(const NTAG2xxImage *image);
+  // Safe from any thread, costs one atomic store. The image takes over at the
+  // start of the next field session (REQA/WUPA or reset), so an initiator
+  // never sees two images in one session and the PN532 is left alone
+  void switchImage(const NTAG2xxImage *image);
+  const NTAG2xxImage *activeImage() const { return image; }
+
+  // Back to the power-on state, e.g. after the field drops
+  void reset();
+
+  // command is the initiator's frame as received, with or without its CRC_A
+  void handleCommand(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+
+  int pageCount() const { return image ? image->pageCount : 0; }
+  // Current memory contents, including writes from the initiator
+  const uint8_t *memory() const { return pages; }
+
+private:
+  typedef void (NTAG2xxEmulator::*CommandHandler)(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+
+  struct CommandEntry {
+    CommandHandler handler;
+    uint8_t size; // Without CRC_A, 0 = variable (handler checks)
+    bool hasCRC; // Command carries a CRC_A when it is not stripped by the PN532
+  };
+
+  struct CommandTable {
+    CommandEntry entries[256];
+  };
+
+  static constexpr CommandTable buildCommandTable();
+  static const CommandTable commandTable;
+
+  enum State {
+    StateIdle,
+    StateActive,
+    StateHalted, // Only WUPA wakes us
+    StateCompatibilityWrite, // Waiting for the 16 byte data half of COMP_WRITE
+  };
+
+  // Fixed answers, prepared once per image
+  struct PreparedFrame {
+    uint8_t bytes[PN532_NORMAL_FRAME_OVERHEAD + 2 + NTAG2XX_SIGNATURE_SIZE + 2];
+    size_t size;
+  };
+
+  void handleRequest(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+  void handleSelect(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+  void handleRead(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+  void handleFastRead(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+  void handleGetVersion(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+  void handleReadSignature(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+  void handlePasswordAuth(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+  void handleReadCounter(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+  void handleWrite(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+  void handleCompatibilityWrite(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+  void handleHalt(const uint8_t *command, size_t commandSize, NTAG2xxResponse *response);
+
+  void applyImage(const NTAG2xxImage *newImage);
+  int writePage(uint8_t page, const uint8_t *bytes);
+  void countRead();
+
+  static void prepare(PreparedFrame *frame, const uint8_t *data, size_t dataSize, bool appendCRC);
+  static void respond(NTAG2xxResponse *response, const PreparedFrame &frame, uint8_t bitsInLastByte = 0);
+  // Encodes a one-off answer into scratchFrame
+  void respondWith(NTAG2xxResponse *response, const uint8_t *data, size_t dataSize);
+
+  const NTAG2xxImage *image;
+  std::atomic<const NTAG2xxImage *> pendingImage;
+  NTAG2xxImageStorage ownImage; // Backs the load() overloads that build their own image
+
+  uint8_t pages[NTAG2XX_MAX_PAGES * 4]; // Writable copy of the image
+  // The image's READ frames, except where a write has redirected one to writtenFrames
+  const uint8_t *readFrames[NTAG2XX_MAX_PAGES];
+  uint8_t writtenFrames[NTAG2XX_MAX_PAGES][NTAG2XX_READ_FRAME_SIZE];
+  uint8_t cascadeLevels[2][5]; // UID part + BCC sent at each cascade level
+
+  State state;
+  uint8_t compatibilityWritePage;
+  uint32_t readCounter; // 24-bit NFC counter, bumped on the first read of a session
+  bool readCounted;
+
+  PreparedFrame atqaFrame;
+  PreparedFrame ackFrame;
+  PreparedFrame nakInvalidFrame; // NAK 0x0: invalid argument or command
+  PreparedFrame nakCRCFrame; // NAK 0x1: parity or CRC error
+  PreparedFrame cascadeLevel1Frame; // CT UID0-2 BCC
+  PreparedFrame cascadeLevel2Frame; // UID3-6 BCC
+  PreparedFrame sakCascadeFrame; // SAK with cascade bit, after CL1 select
+  PreparedFrame sakFrame; // Final SAK, after CL2 select
+  PreparedFrame versionFrame;
+  PreparedFrame signatureFrame;
+  PreparedFrame packFrame;
+
+  uint8_t scratchFrame[PN532_MAX_FRAME_SIZE];
+};
+
+#endif
@@ -0,0 +1,176 @@
+#include "pn532-async.h"
+#include "pn532-simulator.h"
+#include "pn532-transport.h"
+#include "pn532.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// PN532AsyncDevice against PN532Simulator, no reader needed: make test
+
+static int failures = 0;
+
+#define CHECK(condition)                                              \
+  do {                                                                \
+    if (!(condition)) {                                               \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+// Counts frames written, to see how often a command was sent
+class CountingTransport : public PN532MemoryTransport {
+public:
+  CountingTransport(PN532Simulator *simulator) : PN532MemoryTransport(simulator) { writes = 0; }
+
+  int write(const uint8_t *data, size_t size) override {
+    writes++;
+    return PN532MemoryTransport::write(data, size);
+  }
+
+  int writes;
+};
+
+static const int commandCount = 40;
+
+static uint16_t registerAddress(int i) {
+  return 0x6300 | (0x10 + i);
+}
+
+// Futures and callbacks, interleaved: each ReadRegister gets its own
+// register's value back, and completions run in submission order
+static void testOrder() {
+  PN532Simulator simulator;
+  simulator.setAwake(true);
+  PN532 device(new PN532MemoryTransport(&simulator));
+  PN532AsyncDevice async(&device);
+
+  for (int i = 0; i < commandCount; i++) {
+    uint16_t address = registerAddress(i);
+    const uint8_t write[] = { PN532::TxWriteRegister, (uint8_t)(address >> 8), (uint8_t)address, (uint8_t)(i * 3 + 1) };
+    async.submit(write, sizeof(write), 100);
+  }
+
+  std::vector<int> completed; // Only touched on the I/O thread until stop()
+  std::vector<std::future<PN532CommandResult>> futures(commandCount);
+  std::vector<int> values(commandCount, -1);
+
+  for (int i = 0; i < commandCount; i++) {
+    uint16_t address = registerAddress(i);
+    const uint8_t read[] = { PN532::TxReadRegister, (uint8_t)(address >> 8), (uint8_t)address };
+
+    if (i % 2) {
+      async.submit(read, sizeof(read), 100, [i, &completed, &values](const PN532CommandResult &result) {
+        completed.push_back(i);
+        PN532Frame response = result.response();
+        if (result.status > 0 && response.command() == PN532::RxReadRegister && response.payloadSize() == 1) values[i] = response.payload()[0];
+      });
+    } else {
+      futures[i] = async.submit(read, sizeof(read), 100);
+      // Goes through the queue right behind its command
+      async.run([i, &completed](PN532 &device) {
+        completed.push_back(i);
+        return 0;
+      });
+    }
+  }
+
+  for (int i = 0; i < commandCount; i += 2) {
+    PN532CommandResult result = futures[i].get();
+    PN532Frame response = result.response();
+    CHECK(result.status > 0);
+    CHECK(response.command() == PN532::RxReadRegister);
+    CHECK(response.payloadSize() == 1 && response.payload()[0] == i * 3 + 1);
+  }
+
+  async.stop();
+
+  CHECK((int)completed.size() == commandCount);
+  for (size_t i = 0; i < completed.size(); i++) CHECK(completed[i] == (int)i);
+  for (int i = 1; i < commandCount; i += 2) CHECK(values[i] == i * 3 + 1);
+}
+
+// Nobody answering: the command is sent MAX_COMMAND_ATTEMPTS (3) times, then fails
+static void testSilentReader() {
+  PN532Simulator simulator;
+  simulator.setAwake(true);
+  CountingTransport *transport = new CountingTransport(&simulator);
+  simulator.setHostBaudRate(9600); // The chip stays at 115200 and hears only noise
+  PN532 device(transport);
+  PN532AsyncDevice async(&device);
+
+  const uint8_t command[] = { PN532::TxGetFirmwareVersion };
+  PN532CommandResult result = async.submit(command, sizeof(command), 10).get();
+  CHECK(result.status == -1);
+  CHECK(result.frame.empty());
+
+  std::future<int> writes = async.run([transport](PN532 &device) { return transport->writes; });
+  CHECK(writes.get() == 3);
+}
+
+// stop() runs everything queued before it, and refuses anything after
+static void testStopDrains() {
+  PN532Simulator simulator;
+  simulator.setAwake(true);
+  PN532 device(new PN532MemoryTransport(&simulator));
+  PN532AsyncDevice async(&device);
+
+  // Hold the I/O thread so the queue fills up behind it
+  std::promise<void> gate;
+  std::shared_future<void> opened = gate.get_future().share();
+  async.run([opened](PN532 &device) {
+    opened.wait();
+    return 0;
+  });
+
+  const uint8_t command[] = { PN532::TxGetFirmwareVersion };
+  std::vector<std::future<PN532CommandResult>> futures;
+  for (int i = 0; i < commandCount; i++) futures.push_back(async.submit(command, sizeof(command), 100));
+  int callbacks = 0;
+  for (int i = 0; i < commandCount; i++) {
+    async.submit(command, sizeof(command), 100, [&callbacks](const PN532CommandResult &result) {
+      if (result.status > 0 && result.response().command() == PN532::RxGetFirmwareVersion) callbacks++;
+    });
+  }
+
+  gate.set_value();
+  async.stop();
+
+  for (size_t i = 0; i < futures.size(); i++) {
+    CHECK(futures[i].wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    CHECK(futures[i].get().status > 0);
+  }
+  CHECK(callbacks == commandCount);
+
+  // Too late: completed at once instead of waiting on a thread that is gone
+  std::future<PN532CommandResult> late = async.submit(command, sizeof(command), 100);
+  CHECK(late.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+  CHECK(late.get().status == -1);
+
+  int lateStatus = 0;
+  async.submit(command, sizeof(command), 100, [&lateStatus](const PN532CommandResult &result) { lateStatus = result.status; });
+  CHECK(lateStatus == -1);
+
+  std::future<int> lateRun = async.run([](PN532 &device) { return 1; });
+  CHECK(lateRun.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+  CHECK(lateRun.get() == -1);
+
+  // Concurrent stops all return once the thread is joined
+  std::thread other([&async]() { async.stop(); });
+  async.stop();
+  other.join();
+}
+
+int main() {
+  testOrder();
+  testSilentReader();
+  testStopDrains();
+
+  if (failures) {
+    printf("pn532-async-test: %d failures\n", failures);
+    return 1;
+  }
+
+  printf("pn532-async-test: OK\n");
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include "pn532-async.h"
+#include "pn532.h"
+
+#include <memory>
+
+PN532Frame PN532CommandResult::response() const {
+  if (status <= 0) return PN532Frame();
+
+  PN532FrameHeader header;
+  pn532DecodeFrameHeader(frame.data(), frame.size(), &header);
+  return PN532Frame(frame.data(), header);
+}
+
+PN532AsyncDevice::PN532AsyncDevice(PN532 *device) {
+  this->device = device;
+  stopping = false;
+  thread = std::thread(&PN532AsyncDevice::ioLoop, this);
+}
+
+PN532AsyncDevice::~PN532AsyncDevice() {
+  stop();
+}
+
+std::future<PN532CommandResult> PN532AsyncDevice::submit(const uint8_t *command, size_t commandSize, int timeout) {
+  std::shared_ptr<std::promise<PN532CommandResult>> promise = std::make_shared<std::promise<PN532CommandResult>>();
+  std::future<PN532CommandResult> result = promise->get_future();
+
+  submit(command, commandSize, timeout, [promise](const PN532CommandResult &result) {
+    promise->set_value(result);
+  });
+
+  return result;
+}
+
+void PN532AsyncDevice::submit(const uint8_t *command, size_t commandSize, int timeout, Completion completion) {
+  std::vector<uint8_t> commandCopy(command, command + commandSize);
+
+  bool queued = enqueue([this, commandCopy, timeout, completion]() {
+    PN532Frame response;
+    PN532CommandResult result;
+    result.status = device->sendCommand(commandCopy.data(), commandCopy.size(), response, timeout);
+    if (result.status > 0) result.frame.assign(response.raw(), response.raw() + result.status);
+
+    completion(result);
+  });
+
+  if (!queued) {
+    PN532CommandResult result;
+    result.status = -1;
+    completion(result);
+  }
+}
+
+std::future<int> PN532AsyncDevice::run(std::function<int(PN532 &device)> work) {
+  std::shared_ptr<std::promise<int>> promise = std::make_shared<std::promise<int>>();
+  std::future<int> result = promise->get_future();
+
+  bool queued = enqueue([this, promise, work]() {
+    promise->set_value(work(*device));
+  });
+  if (!queued) promise->set_value(-1);
+
+  return result;
+}
+
+void PN532AsyncDevice::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+
+  // Every caller waits for the one join
+  std::call_once(joined, [this]() { thread.join(); });
+}
+
+bool PN532AsyncDevice::enqueue(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) return false; // The I/O thread may be gone already
+    jobs.push_back(std::move(job));
+  }
+  wake.notify_one();
+  return true;
+}
+
+void PN532AsyncDevice::ioLoop() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+      if (jobs.empty()) return; // Only when stopping
+
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+
+    job();
+  }
+}
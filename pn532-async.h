@@ -0,0 +1,66 @@
+#ifndef PN532_ASYNC_H
+#define PN532_ASYNC_H
+
+#include "pn532-frame.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+class PN532;
+
+// Result of one asynchronous command. The response is copied out of the
+// receive buffer, so unlike a PN532Frame from sendCommand it stays valid
+struct PN532CommandResult {
+  int status; // sendCommand's return: response size, 0 = no response, < 0 = error
+  std::vector<uint8_t> frame; // Whole response frame, preamble to postamble
+
+  PN532Frame response() const;
+};
+
+// Runs every command for one PN532 on a dedicated I/O thread that owns the
+// port. Callers submit commands and get a future or a completion callback,
+// so they can prepare the next command or serve other readers meanwhile.
+// Commands run one at a time, in submission order
+class PN532AsyncDevice {
+public:
+  typedef std::function<void(const PN532CommandResult &result)> Completion;
+
+  // device is not owned, and must only be used through this object until stop()
+  PN532AsyncDevice(PN532 *device);
+  ~PN532AsyncDevice();
+
+  std::future<PN532CommandResult> submit(const uint8_t *command, size_t commandSize, int timeout);
+  // completion runs on the I/O thread
+  void submit(const uint8_t *command, size_t commandSize, int timeout, Completion completion);
+
+  // Any other device work (readTagId, ntag2xxDumpTag, ...), run on the I/O thread in order
+  std::future<int> run(std::function<int(PN532 &device)> work);
+
+  // Finishes the commands already submitted, then joins the I/O thread.
+  // Anything submitted after this fails straight away with -1
+  void stop();
+
+private:
+  // false once stopping, the job is dropped and the caller completes it
+  bool enqueue(std::function<void()> job);
+  void ioLoop();
+
+  PN532 *device;
+  std::thread thread;
+  std::once_flag joined; // stop() may race with the destructor or another stop()
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::function<void()>> jobs;
+  bool stopping;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef PN532_COMMANDS_H
+#define PN532_COMMANDS_H
+
+#include "pn532-frame.h"
+#include "pn532.h"
+
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+// What the library knows about each PN532 command. Frames from
+// pn532CommandFrame are checked against it at compile time, and printFrame and
+// PN532Simulator decode with it, so encoding and decoding cannot drift apart
+struct PN532CommandDescriptor {
+  uint8_t code; // Host -> PN532. The response is code + 1
+  const char *name;
+  uint16_t minSize; // Command code + parameters
+  uint16_t maxSize;
+};
+
+static constexpr PN532CommandDescriptor pn532Commands[] = {
+  { PN532::TxGetFirmwareVersion, "GetFirmwareVersion", 1, 1 },
+  { PN532::TxReadRegister, "ReadRegister", 3, PN532_NORMAL_FRAME_MAX_LENGTH - 1 }, // 2-byte addresses
+  { PN532::TxWriteRegister, "WriteRegister", 4, PN532_NORMAL_FRAME_MAX_LENGTH - 1 }, // Address + value
+  { PN532::TxSetSerialBaudRate, "SetSerialBaudRate", 2, 2 },
+  { PN532::TxSetParameters, "SetParameters", 2, 2 },
+  { PN532::TxSAMConfiguration, "SAMConfiguration", 2, 4 }, // Mode, optional timeout and IRQ
+  { PN532::TxRFConfiguration, "RFConfiguration", 3, 13 }, // Item + up to 11 values
+  { PN532::TxInDataExchange, "InDataExchange", 2, 1 + 1 + 262 }, // Tg + data
+  { PN532::TxInCommunicateThrough, "InCommunicateThrough", 1, 1 + 262 },
+  { PN532::TxInListPassiveTarget, "InListPassiveTarget", 3, 64 }, // MaxTg, BrTy, initiator data
+  { PN532::TxTgGetData, "TgGetData", 1, 1 },
+  { PN532::TxTgInitAsTarget, "TgInitAsTarget", 38, 133 }, // Up to 47 general and 48 historical bytes
+  { PN532::TxTgGetInitiatorCommand, "TgGetInitiatorCommand", 1, 1 },
+  { PN532::TxTgResponseToInitiator, "TgResponseToInitiator", 1, 1 + 262 },
+};
+
+// Descriptor for a command or response code, NULL if unknown
+constexpr const PN532CommandDescriptor *pn532FindCommand(uint8_t code) {
+  for (const PN532CommandDescriptor &descriptor : pn532Commands) {
+    if (descriptor.code == code || descriptor.code + 1 == code) return &descriptor;
+  }
+  return NULL;
+}
+
+// True if a host command of size bytes (code included) is well formed
+constexpr bool pn532CommandSizeValid(uint8_t code, size_t size) {
+  const PN532CommandDescriptor *descriptor = pn532FindCommand(code);
+  return descriptor && descriptor->code == code && size >= descriptor->minSize && size <= descriptor->maxSize;
+}
+
+// Complete host-to-PN532 normal frame for an N byte command
+template <size_t N>
+struct PN532CommandFrame {
+  uint8_t bytes[N + 1 + PN532_NORMAL_FRAME_OVERHEAD]; // + TFI
+
+  constexpr size_t size() const { return N + 1 + PN532_NORMAL_FRAME_OVERHEAD; }
+
+  // Replaces byte index of the command (0 = command code) in a copy of a
+  // prepared frame, patching DCS instead of summing the frame again
+  void set(size_t index, uint8_t value) {
+    uint8_t &byte = bytes[6 + index];
+    bytes[6 + N] += byte - value;
+    byte = value;
+  }
+};
+
+template <size_t N>
+constexpr PN532CommandFrame<N> pn532BuildCommandFrame(uint8_t code, const uint8_t *parameters) {
+  static_assert(N + 1 <= PN532_NORMAL_FRAME_MAX_LENGTH, "Command too long for a normal frame");
+
+  PN532CommandFrame<N> frame = {};
+  frame.bytes[0] = 0x00; // Preamble
+  frame.bytes[1] = 0x00; // Start code
+  frame.bytes[2] = 0xFF;
+  frame.bytes[3] = N + 1; // LEN: TFI + command
+  frame.bytes[4] = (uint8_t)(0 - (N + 1)); // LCS
+  frame.bytes[5] = 0xD4; // Host to PN532
+  frame.bytes[6] = code;
+  for (size_t i = 0; i + 1 < N; i++) frame.bytes[7 + i] = parameters[i];
+
+  uint8_t dcs = 0;
+  for (size_t i = 5; i < 6 + N; i++) dcs -= frame.bytes[i];
+  frame.bytes[6 + N] = dcs;
+  frame.bytes[7 + N] = 0x00; // Postamble
+  return frame;
+}
+
+// Frames for fixed commands, built at compile time:
+//   static constexpr auto frame = pn532CommandFrame<PN532::TxGetFirmwareVersion>();
+//   static constexpr auto readFrame = pn532CommandFrame<PN532::TxInDataExchange>({ 1, PN532::NTAG21xReadPage, 0 });
+// Parameterised commands start from such a frame and set() the variable bytes
+template <uint8_t Code>
+constexpr PN532CommandFrame<1> pn532CommandFrame() {
+  static_assert(pn532CommandSizeValid(Code, 1), "Command size does not match its descriptor");
+  return pn532BuildCommandFrame<1>(Code, NULL);
+}
+
+template <uint8_t Code, size_t N>
+constexpr PN532CommandFrame<N + 1> pn532CommandFrame(const uint8_t (&parameters)[N]) {
+  static_assert(pn532CommandSizeValid(Code, N + 1), "Command size does not match its descriptor");
+  return pn532BuildCommandFrame<N + 1>(Code, parameters);
+}
+
+#endif
@@ -0,0 +1,228 @@
+#include "pn532-frame.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Hardware-free checks of the frame codec: make test
+
+static int failures = 0;
+
+#define CHECK(condition)                                              \
+  do {                                                                \
+    if (!(condition)) {                                               \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+static const uint8_t ackFrame[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+static const uint8_t nackFrame[] = { 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00 };
+static const uint8_t errorFrame[] = { 0x00, 0x00, 0xFF, 0x01, 0xFF, 0x7F, 0x81, 0x00 };
+
+// Runs a byte stream through the decoder chunk bytes at a time, resyncing the
+// way readSerialFrame does: on a rejection drop the candidate's first byte
+// and feed again from the next. Returns the frame's offset in the stream, or
+// -1 if none was found
+static int decodeStream(const uint8_t *stream, size_t size, size_t chunk, PN532FrameHeader *header) {
+  PN532FrameDecoder decoder;
+  size_t start = 0;
+  size_t decoded = 0;
+
+  while (start + decoded < size) {
+    size_t count = size - start - decoded;
+    if (count > chunk) count = chunk;
+
+    size_t used;
+    PN532DecodeResult result = decoder.feed(stream + start + decoded, count, &used);
+    decoded += used;
+
+    if (result == PN532DecodeComplete) {
+      *header = decoder.header();
+      return start;
+    }
+
+    if (result != PN532DecodeMore) {
+      start++;
+      decoded = 0;
+      decoder.reset();
+    }
+  }
+
+  return -1;
+}
+
+static void testRoundTrip(size_t dataSize) {
+  uint8_t data[400];
+  for (size_t i = 0; i < dataSize; i++) data[i] = i * 37 + 11;
+
+  uint8_t frame[PN532_MAX_FRAME_SIZE];
+  int frameSize = pn532EncodeFrame(0xD5, data, dataSize, frame, sizeof(frame));
+  CHECK(frameSize == (int)pn532FrameSize(dataSize));
+
+  bool extended = dataSize + 1 > PN532_NORMAL_FRAME_MAX_LENGTH;
+  PN532FrameType expectedType = extended ? PN532FrameExtended : PN532FrameNormal;
+
+  PN532FrameHeader header;
+  CHECK(pn532DecodeFrameHeader(frame, frameSize, &header) == expectedType);
+  CHECK(header.frameSize == (size_t)frameSize);
+  CHECK(header.length == dataSize + 1);
+  CHECK(header.tfiOffset == (extended ? 8u : 5u));
+
+  PN532FrameDecoder decoder;
+  size_t used;
+  CHECK(decoder.feed(frame, frameSize, &used) == PN532DecodeComplete);
+  CHECK(used == (size_t)frameSize);
+  CHECK(decoder.header().type == expectedType);
+  CHECK(decoder.header().length == dataSize + 1);
+
+  PN532Frame view(frame, decoder.header());
+  CHECK(view.tfi() == 0xD5);
+  CHECK(view.command() == data[0]);
+  CHECK(view.payloadSize() == dataSize - 1);
+  CHECK(memcmp(view.payload(), data + 1, dataSize - 1) == 0);
+}
+
+static void testControlFrames() {
+  PN532FrameHeader header;
+  CHECK(pn532DecodeFrameHeader(ackFrame, sizeof(ackFrame), &header) == PN532FrameAck);
+  CHECK(header.frameSize == sizeof(ackFrame));
+  CHECK(pn532DecodeFrameHeader(nackFrame, sizeof(nackFrame), &header) == PN532FrameNack);
+  CHECK(header.frameSize == sizeof(nackFrame));
+  CHECK(pn532DecodeFrameHeader(errorFrame, sizeof(errorFrame), &header) == PN532FrameError);
+  CHECK(header.frameSize == sizeof(errorFrame));
+  CHECK(pn532DecodeFrameHeader(ackFrame, 4, &header) == PN532FrameIncomplete);
+
+  const uint8_t *frames[] = { ackFrame, nackFrame, errorFrame };
+  const size_t sizes[] = { sizeof(ackFrame), sizeof(nackFrame), sizeof(errorFrame) };
+  const PN532FrameType types[] = { PN532FrameAck, PN532FrameNack, PN532FrameError };
+
+  for (int i = 0; i < 3; i++) {
+    PN532FrameDecoder decoder;
+    size_t used;
+    CHECK(decoder.feed(frames[i], sizes[i], &used) == PN532DecodeComplete);
+    CHECK(used == sizes[i]);
+    CHECK(decoder.header().type == types[i]);
+    CHECK(decoder.header().frameSize == sizes[i]);
+  }
+}
+
+static void testBadChecksums() {
+  const uint8_t data[] = { 0x41, 0x00, 0x01, 0x02, 0x03 };
+  uint8_t frame[32];
+  int frameSize = pn532EncodeFrame(0xD5, data, sizeof(data), frame, sizeof(frame));
+
+  uint8_t badLength[32];
+  memcpy(badLength, frame, frameSize);
+  badLength[4] ^= 0x01; // LCS
+
+  PN532FrameDecoder decoder;
+  size_t used;
+  CHECK(decoder.feed(badLength, frameSize, &used) == PN532DecodeBadLength);
+  CHECK(used == 5); // Rejected on the LCS byte itself
+
+  uint8_t badData[32];
+  memcpy(badData, frame, frameSize);
+  badData[7] ^= 0x10; // Data byte, so DCS no longer matches
+
+  decoder.reset();
+  CHECK(decoder.feed(badData, frameSize, &used) == PN532DecodeBadChecksum);
+  CHECK(used == (size_t)frameSize - 1); // Rejected on DCS, before the postamble
+
+  // Extended frames check LCS over both length bytes, and DCS the same way
+  uint8_t bigData[300];
+  memset(bigData, 0xA5, sizeof(bigData));
+  uint8_t extended[PN532_MAX_FRAME_SIZE];
+  int extendedSize = pn532EncodeFrame(0xD5, bigData, sizeof(bigData), extended, sizeof(extended));
+
+  extended[6] ^= 0x01; // LENL
+  decoder.reset();
+  CHECK(decoder.feed(extended, extendedSize, &used) == PN532DecodeBadLength);
+  CHECK(used == 8);
+  extended[6] ^= 0x01;
+
+  extended[200] ^= 0x01;
+  decoder.reset();
+  CHECK(decoder.feed(extended, extendedSize, &used) == PN532DecodeBadChecksum);
+  CHECK(used == (size_t)extendedSize - 1);
+}
+
+static void testResync() {
+  const uint8_t data[] = { 0x4B, 0x01, 0x01, 0x00, 0x44, 0x00, 0x07 };
+  uint8_t frame[32];
+  int frameSize = pn532EncodeFrame(0xD5, data, sizeof(data), frame, sizeof(frame));
+
+  // Noise that almost looks like a start code, then a frame with a bad LCS,
+  // then the real frame
+  uint8_t stream[64];
+  const uint8_t noise[] = { 0x12, 0xFF, 0x00, 0x00, 0x00, 0xFF, 0x05, 0x05 };
+  memcpy(stream, noise, sizeof(noise));
+  memcpy(stream + sizeof(noise), frame, frameSize);
+  size_t streamSize = sizeof(noise) + frameSize;
+
+  const size_t chunks[] = { 1, 2, 3, 64 };
+  for (size_t chunk : chunks) {
+    PN532FrameHeader header;
+    CHECK(decodeStream(stream, streamSize, chunk, &header) == (int)sizeof(noise));
+    CHECK(header.type == PN532FrameNormal);
+    CHECK(header.frameSize == (size_t)frameSize);
+  }
+
+  // A frame with a corrupt data byte, directly followed by a good ACK
+  uint8_t corrupt[64];
+  memcpy(corrupt, frame, frameSize);
+  corrupt[8] ^= 0x40;
+  memcpy(corrupt + frameSize, ackFrame, sizeof(ackFrame));
+
+  PN532FrameHeader header;
+  CHECK(decodeStream(corrupt, frameSize + sizeof(ackFrame), 64, &header) == frameSize);
+  CHECK(header.type == PN532FrameAck);
+
+  // Only noise: nothing found
+  CHECK(decodeStream(noise, sizeof(noise), 64, &header) == -1);
+}
+
+static void testSplitFeeds() {
+  uint8_t data[300];
+  for (size_t i = 0; i < sizeof(data); i++) data[i] = i;
+
+  const size_t sizes[] = { 19, 300 }; // Normal and extended
+  for (size_t size : sizes) {
+    uint8_t frame[PN532_MAX_FRAME_SIZE];
+    int frameSize = pn532EncodeFrame(0xD5, data, size, frame, sizeof(frame));
+
+    // Every split point, including splits inside the header and right before DCS
+    for (int split = 1; split < frameSize; split++) {
+      PN532FrameDecoder decoder;
+      size_t used;
+      CHECK(decoder.feed(frame, split, &used) == PN532DecodeMore);
+      CHECK(used == (size_t)split);
+      CHECK(decoder.feed(frame + split, frameSize - split, &used) == PN532DecodeComplete);
+      CHECK(used == (size_t)(frameSize - split));
+    }
+
+    // And a byte at a time
+    PN532FrameDecoder decoder;
+    for (int i = 0; i < frameSize; i++) {
+      PN532DecodeResult result = decoder.feed(frame[i]);
+      CHECK(result == (i + 1 == frameSize ? PN532DecodeComplete : PN532DecodeMore));
+    }
+  }
+}
+
+int main() {
+  const size_t sizes[] = { 1, 2, 19, 253, 254, 262, 400 };
+  for (size_t size : sizes) testRoundTrip(size);
+
+  testControlFrames();
+  testBadChecksums();
+  testResync();
+  testSplitFeeds();
+
+  if (failures) {
+    printf("pn532-frame-test: %d failures\n", failures);
+    return 1;
+  }
+
+  printf("pn532-frame-test: OK\n");
+  return 0;
+}
@@ -0,0 +1,261 @@
+#include "pn532-frame.h"
+
+#include <string.h>
+
+size_t pn532FrameSize(size_t dataSize) {
+  size_t length = dataSize + 1; // + TFI
+  if (length <= PN532_NORMAL_FRAME_MAX_LENGTH) return length + PN532_NORMAL_FRAME_OVERHEAD;
+
+  return length + PN532_EXTENDED_FRAME_OVERHEAD;
+}
+
+int pn532EncodeFrame(uint8_t tfi, const uint8_t *data, size_t dataSize, uint8_t *frame, size_t frameBufferSize) {
+  size_t length = dataSize + 1; // Size of data + size of TFI
+  if (length > PN532_EXTENDED_FRAME_MAX_LENGTH) return -1;
+
+  size_t frameSize = pn532FrameSize(dataSize);
+  if (frameSize > frameBufferSize) return -1;
+
+  frame[0] = 0x00; // Preamble
+  frame[1] = 0x00; // Start code 0
+  frame[2] = 0xFF; // Start code 1
+
+  size_t tfiOffset;
+  if (length <= PN532_NORMAL_FRAME_MAX_LENGTH) {
+    frame[3] = length;
+    frame[4] = 0 - length; // Length checksum (LCS)
+    tfiOffset = 5;
+  } else {
+    frame[3] = 0xFF; // Extended frame marker
+    frame[4] = 0xFF;
+    frame[5] = length >> 8; // LENM
+    frame[6] = length & 0xFF; // LENL
+    frame[7] = 0 - (frame[5] + frame[6]); // LCS covers both length bytes
+    tfiOffset = 8;
+  }
+
+  frame[tfiOffset] = tfi; // Frame indicator (TFI). 0xD4 = controller to PN532, 0xD5 = PN532 to controller
+  memcpy(frame + tfiOffset + 1, data, dataSize); // Copy over data
+
+  uint8_t dcs = 0x00; // Equivalent to 256
+  dcs -= tfi;
+  for (size_t i = 0; i < dataSize; i++) { dcs -= data[i]; }
+
+  frame[tfiOffset + length] = dcs;
+  frame[tfiOffset + length + 1] = 0x00; // Postamble
+
+  return frameSize;
+}
+
+PN532FrameType pn532DecodeFrameHeader(const uint8_t *frame, size_t available, PN532FrameHeader *header) {
+  header->type = PN532FrameIncomplete;
+  header->frameSize = 0;
+  header->tfiOffset = 0;
+  header->length = 0;
+
+  if (available < 5) return PN532FrameIncomplete;
+
+  // Byte 4 tells us the length (or that this is an ACK/NACK/extended frame)
+  uint8_t length = frame[3];
+
+  switch (length) {
+  case 0x00: // Start of ACK code
+    if (frame[4] != 0xFF) return header->type = PN532FrameInvalid;
+
+    header->type = PN532FrameAck;
+    header->frameSize = 6;
+    return header->type;
+
+  case 0xFF: // Start of NACK code or Extended Information Frame code
+    switch (frame[4]) {
+    case 0x00: // End of NACK code
+      header->type = PN532FrameNack;
+      header->frameSize = 6;
+      return header->type;
+
+    case 0xFF: // End of Extended Information Frame code
+      if (available < 8) return PN532FrameIncomplete;
+
+      header->type = PN532FrameExtended;
+      header->length = (frame[5] << 8) | frame[6];
+      header->tfiOffset = 8;
+      header->frameSize = header->length + PN532_EXTENDED_FRAME_OVERHEAD;
+      return header->type;
+
+    default:
+      return header->type = PN532FrameInvalid;
+    }
+
+  case 0x01: // Error frame: 00 00 FF 01 FF 7F 81 00
+    header->type = PN532FrameError;
+    header->length = 1;
+    header->tfiOffset = 5;
+    header->frameSize = 8;
+    return header->type;
+
+  default: // Information packet
+    header->type = PN532FrameNormal;
+    header->length = length;
+    header->tfiOffset = 5;
+    header->frameSize = length + PN532_NORMAL_FRAME_OVERHEAD; // Provided length + 7 bytes of frame overhead
+    return header->type;
+  }
+}
+
+// Sum of size bytes, modulo 256, added eight at a time. Each word is split
+// into four 16-bit lanes, which cannot overflow for anything up to
+// PN532_MAX_FRAME_SIZE
+static uint8_t byteSum(const uint8_t *data, size_t size) {
+  const uint64_t lowBytes = 0x00FF00FF00FF00FFull;
+  uint64_t lanes = 0;
+
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    lanes += (word & lowBytes) + ((word >> 8) & lowBytes);
+  }
+
+  uint8_t sum = lanes + (lanes >> 16) + (lanes >> 32) + (lanes >> 48);
+  for (; i < size; i++) sum += data[i];
+  return sum;
+}
+
+void PN532FrameDecoder::reset() {
+  fed = 0;
+  checksum = 0;
+  frameHeader.type = PN532FrameIncomplete;
+  frameHeader.frameSize = 0;
+  frameHeader.tfiOffset = 0;
+  frameHeader.length = 0;
+}
+
+PN532DecodeResult PN532FrameDecoder::feed(uint8_t byte) {
+  static const uint8_t startCode[] = { 0x00, 0x00, 0xFF }; // Preamble + start code
+
+  size_t index = fed++;
+  if (index < sizeof(startCode)) return byte == startCode[index] ? PN532DecodeMore : PN532DecodeNoise;
+  if (!frameHeader.frameSize) return decodeLength(index, byte);
+
+  if (fed == frameHeader.frameSize) return PN532DecodeComplete; // Postamble, checked by the caller
+  if (fed == frameHeader.frameSize - 1) return (uint8_t)(checksum + byte) == 0 ? PN532DecodeMore : PN532DecodeBadChecksum; // DCS
+
+  checksum += byte; // TFI or data
+  return PN532DecodeMore;
+}
+
+PN532DecodeResult PN532FrameDecoder::feed(const uint8_t *bytes, size_t count, size_t *used) {
+  size_t i = 0;
+  PN532DecodeResult result = PN532DecodeMore;
+
+  while (i < count && result == PN532DecodeMore) {
+    if (frameHeader.frameSize && fed >= frameHeader.tfiOffset && fed + 2 < frameHeader.frameSize) {
+      // TFI and data, up to DCS
+      size_t run = frameHeader.frameSize - 2 - fed;
+      if (run > count - i) run = count - i;
+
+      checksum += byteSum(bytes + i, run);
+      fed += run;
+      i += run;
+      continue;
+    }
+
+    result = feed(bytes[i++]);
+  }
+
+  *used = i;
+  return result;
+}
+
+PN532DecodeResult PN532FrameDecoder::decodeLength(size_t index, uint8_t byte) {
+  switch (index) {
+  case 3: // LEN, or the first half of an ACK/NACK/extended marker
+    frameHeader.length = byte;
+    return PN532DecodeMore;
+
+  case 4: { // LCS
+    uint8_t length = frameHeader.length;
+    if ((length == 0x00 && byte == 0xFF) || (length == 0xFF && byte == 0x00)) {
+      frameHeader.type = length == 0x00 ? PN532FrameAck : PN532FrameNack;
+      frameHeader.length = 0;
+      frameHeader.frameSize = 6;
+      return PN532DecodeMore;
+    }
+
+    if (length == 0xFF && byte == 0xFF) {
+      frameHeader.type = PN532FrameExtended;
+      return PN532DecodeMore;
+    }
+
+    if ((uint8_t)(length + byte) != 0) return PN532DecodeBadLength;
+
+    frameHeader.type = length == 0x01 ? PN532FrameError : PN532FrameNormal; // Error frame: 00 00 FF 01 FF 7F 81 00
+    frameHeader.tfiOffset = 5;
+    frameHeader.frameSize = length + PN532_NORMAL_FRAME_OVERHEAD;
+    return PN532DecodeMore;
+  }
+
+  case 5: // LENM
+    frameHeader.length = byte << 8;
+    return PN532DecodeMore;
+
+  case 6: // LENL
+    frameHeader.length |= byte;
+    return PN532DecodeMore;
+
+  default: { // Extended LCS covers both length bytes
+    size_t length = frameHeader.length;
+    if ((uint8_t)((length >> 8) + (length & 0xFF) + byte) != 0) return PN532DecodeBadLength;
+    if (!length || length + PN532_EXTENDED_FRAME_OVERHEAD > PN532_MAX_FRAME_SIZE) return PN532DecodeBadLength;
+
+    frameHeader.tfiOffset = 8;
+    frameHeader.frameSize = length + PN532_EXTENDED_FRAME_OVERHEAD;
+    return PN532DecodeMore;
+  }
+  }
+}
+
+PN532Frame::PN532Frame() : bytes(NULL) {
+  header.type = PN532FrameIncomplete;
+  header.frameSize = 0;
+  header.tfiOffset = 0;
+  header.length = 0;
+}
+
+PN532Frame::PN532Frame(const uint8_t *bytes, const PN532FrameHeader &header) : bytes(bytes), header(header) {}
+
+PN532RingBuffer::PN532RingBuffer() : head(0), tail(0) {}
+
+void PN532RingBuffer::clear() {
+  head = tail = 0;
+}
+
+uint8_t *PN532RingBuffer::writePointer(size_t *space) {
+  if (head == tail) clear(); // Empty, so start from the front and keep frames from wrapping
+
+  size_t start = tail % capacity;
+  size_t free = capacity - size();
+  size_t untilEnd = capacity - start;
+
+  *space = free < untilEnd ? free : untilEnd;
+  return storage + start;
+}
+
+void PN532RingBuffer::commitWrite(size_t count) {
+  tail += count;
+}
+
+const uint8_t *PN532RingBuffer::peek(size_t count) {
+  size_t start = head % capacity;
+
+  if (start + count > capacity) {
+    size_t wrapped = start + count - capacity;
+    memcpy(storage + capacity, storage, wrapped); // Mirror the wrapped bytes after the end of the ring
+  }
+
+  return storage + start;
+}
+
+void PN532RingBuffer::consume(size_t count) {
+  head += count;
+}
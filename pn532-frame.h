@@ -0,0 +1,147 @@
+#ifndef PN532_FRAME_H
+#define PN532_FRAME_H
+
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+// Normal information frame:
+//   00 00 FF LEN LCS TFI PD0..PDn DCS 00
+// Extended information frame:
+//   00 00 FF FF FF LENM LENL LCS TFI PD0..PDn DCS 00
+// LEN counts TFI + PD bytes
+
+#define PN532_NORMAL_FRAME_MAX_LENGTH 254 // Largest LEN (TFI + data) in a normal frame, 0xFF marks NACK/extended frames
+#define PN532_EXTENDED_FRAME_MAX_LENGTH 0xFFFF
+#define PN532_NORMAL_FRAME_OVERHEAD 7 // Preamble, start code, LEN, LCS, DCS, postamble
+#define PN532_EXTENDED_FRAME_OVERHEAD 10 // Same as above + FF FF marker and 2-byte LEN
+#define PN532_MAX_FRAME_SIZE 512 // Largest frame we accept: 262 bytes of command data plus headers, rounded up
+
+enum PN532FrameType {
+  PN532FrameIncomplete = 0,
+  PN532FrameAck,
+  PN532FrameNack,
+  PN532FrameError,
+  PN532FrameNormal,
+  PN532FrameExtended,
+  PN532FrameInvalid = -1,
+};
+
+struct PN532FrameHeader {
+  PN532FrameType type;
+  size_t frameSize; // Total bytes on the wire, preamble to postamble
+  size_t tfiOffset; // Index of TFI (0 for ACK/NACK)
+  size_t length; // LEN: TFI + data bytes (0 for ACK/NACK)
+};
+
+// Wire size of a frame carrying dataSize bytes after the TFI
+size_t pn532FrameSize(size_t dataSize);
+
+// Builds a complete frame (normal or extended, whichever fits) into frame
+// Returns the frame size, or -1 if frameBufferSize is too small or the data cannot fit any frame
+int pn532EncodeFrame(uint8_t tfi, const uint8_t *data, size_t dataSize, uint8_t *frame, size_t frameBufferSize);
+
+// Works out the type and size of the frame starting at frame[0] from the first available bytes
+// Returns PN532FrameIncomplete until enough of the header has arrived
+PN532FrameType pn532DecodeFrameHeader(const uint8_t *frame, size_t available, PN532FrameHeader *header);
+
+// What PN532FrameDecoder made of the byte it was just fed
+enum PN532DecodeResult {
+  PN532DecodeMore = 0, // Valid so far, the frame is not finished yet
+  PN532DecodeComplete, // header() describes a whole frame with good checksums
+  PN532DecodeNoise, // Not a 00 00 FF start code
+  PN532DecodeBadLength, // LCS mismatch, or a length we cannot take
+  PN532DecodeBadChecksum, // DCS mismatch
+};
+
+// Byte-at-a-time decoder for frames from the PN532. Checks the start code,
+// LCS and DCS as the bytes arrive, so a corrupt frame is rejected on the byte
+// that gives it away rather than after its claimed length has been read.
+//
+// On any rejection the caller drops the first byte of the candidate, resets
+// the decoder and feeds it again from the next byte. That finds a start code
+// hiding inside noise or inside a frame whose LEN was corrupted
+class PN532FrameDecoder {
+public:
+  PN532FrameDecoder() { reset(); }
+
+  void reset();
+  PN532DecodeResult feed(uint8_t byte);
+  // Same for up to count bytes, stopping at the first result that is not
+  // PN532DecodeMore. *used is set to the bytes taken. Runs of data are summed
+  // in one go rather than a byte per call
+  PN532DecodeResult feed(const uint8_t *bytes, size_t count, size_t *used);
+
+  // Valid once feed returned PN532DecodeComplete
+  const PN532FrameHeader &header() const { return frameHeader; }
+
+private:
+  PN532DecodeResult decodeLength(size_t index, uint8_t byte);
+
+  size_t fed;
+  uint8_t checksum; // Running sum of TFI and data, DCS brings it to 0
+  PN532FrameHeader frameHeader; // frameSize stays 0 until LEN and LCS check out
+};
+
+// View of one received frame. Points straight at the received bytes, so it is
+// only valid until the next frame is read from the same buffer
+class PN532Frame {
+public:
+  PN532Frame();
+  PN532Frame(const uint8_t *bytes, const PN532FrameHeader &header);
+
+  PN532FrameType type() const { return header.type; }
+  bool isAck() const { return header.type == PN532FrameAck; }
+  bool isNack() const { return header.type == PN532FrameNack; }
+  bool isError() const { return header.type == PN532FrameError; }
+  bool isInformation() const { return header.type == PN532FrameNormal || header.type == PN532FrameExtended; }
+
+  // Whole frame as received, preamble to postamble
+  const uint8_t *raw() const { return bytes; }
+  size_t rawSize() const { return header.frameSize; }
+
+  // Information frame accessors, each returns 0 when the frame is too short
+  uint8_t tfi() const { return header.length >= 1 ? bytes[header.tfiOffset] : 0; }
+  uint8_t command() const { return header.length >= 2 ? bytes[header.tfiOffset + 1] : 0; } // Response code, e.g. 0x41 for InDataExchange
+  uint8_t status() const { return header.length >= 3 ? bytes[header.tfiOffset + 2] : 0; } // First byte after the response code
+
+  // Everything after the response code
+  const uint8_t *payload() const { return bytes + header.tfiOffset + 2; }
+  size_t payloadSize() const { return header.length >= 2 ? header.length - 2 : 0; }
+
+private:
+  const uint8_t *bytes;
+  PN532FrameHeader header;
+};
+
+// Receive ring buffer. Serial reads go straight into the ring and frames are
+// handed out as views, so nothing is shifted or copied between back-to-back
+// frames. A frame that wraps past the end of the ring has its wrapped tail
+// mirrored into spare space after the end so the view stays contiguous.
+class PN532RingBuffer {
+public:
+  static const size_t capacity = 1024;
+
+  PN532RingBuffer();
+
+  void clear();
+  size_t size() const { return tail - head; }
+
+  // Contiguous free space to read into, then commit what was actually read
+  uint8_t *writePointer(size_t *space);
+  void commitWrite(size_t count);
+
+  // Pointer to the next count bytes (count <= PN532_MAX_FRAME_SIZE), contiguous
+  // until the next write. Only copies when those bytes wrap around the ring
+  const uint8_t *peek(size_t count);
+  void consume(size_t count);
+
+private:
+  uint8_t storage[capacity + PN532_MAX_FRAME_SIZE];
+  size_t head; // Total bytes consumed
+  size_t tail; // Total bytes written
+};
+
+#endif
@@ -0,0 +1,508 @@
+#include "pn532-simulator.h"
+#include "iso14443a-utils.h"
+#include "logger.h"
+#include "ntag2xx-emulation.h"
+#include "pn532-commands.h"
+#include "pn532-frame.h"
+#include "pn532.h"
+#include "time-utils.h"
+
+#include <string.h>
+
+#define ISO14443A_SAK_CASCADE 0x04
+
+static const uint8_t firmwareVersion[] = { 0x32, 0x01, 0x06, 0x07 }; // PN532 v1.6, ISO18092 + Type A + Type B
+static const uint8_t ackFrame[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+static const uint8_t errorFrame[] = { 0x00, 0x00, 0xFF, 0x01, 0xFF, 0x7F, 0x81, 0x00 }; // Syntax error
+
+static const int serialBaudRates[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1288000 }; // By SetSerialBaudRate code
+static const uint8_t selectCodes[3] = { 0x93, 0x95, 0x97 };
+
+PN532Simulator::PN532Simulator() {
+  awake = false;
+  baudRate = PN532_DEFAULT_BAUD_RATE;
+  hostBaudRate = PN532_DEFAULT_BAUD_RATE;
+  pendingBaudRate = 0;
+  maxBaudRate = PN532_MAX_BAUD_RATE;
+
+  // Reset values of the registers the library looks at
+  memset(registers, 0, sizeof(registers));
+  registers[PN532::RegisterCIU_TxControl & 0xFF] = 0x80; // RF field off
+  registers[PN532::RegisterCIU_Coll & 0xFF] = 0xA0; // No collision position
+  passiveActivationRetries = 0xFF;
+
+  tagActive = false;
+
+  scriptPosition = 0;
+  scriptPassesLeft = 0;
+  finished = false;
+  deliveredAt = 0;
+  exchangeLog = NULL;
+
+  commands = 0;
+  targetResponses = 0;
+}
+
+void PN532Simulator::setHostBaudRate(int baudRate) {
+  hostBaudRate = baudRate;
+  pending.clear(); // Half a frame at the old rate is garbage now
+}
+
+void PN532Simulator::setInitiatorScript(const std::vector<std::vector<uint8_t>> &commands, int passes) {
+  script = commands;
+  scriptPosition = 0;
+  scriptPassesLeft = passes;
+  finished = false;
+}
+
+void PN532Simulator::setTag(NTAG2xxEmulator *tag) {
+  field.clear();
+  tagActive = false;
+  if (tag) addTag(tag);
+}
+
+void PN532Simulator::addTag(NTAG2xxEmulator *tag) {
+  FieldTag fieldTag = { tag, FieldIdle };
+  field.push_back(fieldTag);
+}
+
+uint8_t PN532Simulator::registerValue(uint16_t address) const {
+  return (address >> 8) == 0x63 ? registers[address & 0xFF] : 0;
+}
+
+void PN532Simulator::receive(const uint8_t *data, size_t size, std::deque<uint8_t> *output) {
+  if (hostBaudRate != baudRate) return; // Framing errors on our side
+
+  if (!awake) {
+    // Asleep, the UART only notices the 0x55 preamble
+    const uint8_t *wake = (const uint8_t *)memchr(data, 0x55, size);
+    if (!wake) return;
+
+    awake = true;
+    size -= wake - data;
+    data = wake;
+  }
+
+  pending.insert(pending.end(), data, data + size);
+
+  while (true) {
+    // Start code, skipping preambles and anything left of a dropped frame
+    size_t start = 0;
+    while (start + 1 < pending.size() && !(pending[start] == 0x00 && pending[start + 1] == 0xFF)) start++;
+    pending.erase(pending.begin(), pending.begin() + start);
+    if (pending.size() < 4) return;
+
+    uint8_t length = pending[2];
+    uint8_t lengthChecksum = pending[3];
+
+    if (length == 0x00 && lengthChecksum == 0xFF) { // ACK
+      pending.erase(pending.begin(), pending.begin() + 4);
+      if (pendingBaudRate) {
+        baudRate = pendingBaudRate;
+        pendingBaudRate = 0;
+      }
+      continue;
+    }
+
+    if (length == 0xFF && lengthChecksum == 0x00) { // NACK, nothing kept to resend
+      pending.erase(pending.begin(), pending.begin() + 4);
+      continue;
+    }
+
+    size_t headerSize = 4; // 00 FF LEN LCS
+    size_t frameLength = length;
+    if (length == 0xFF && lengthChecksum == 0xFF) { // Extended frame
+      if (pending.size() < 7) return;
+      headerSize = 7;
+      frameLength = pending[4] << 8 | pending[5];
+      lengthChecksum = pending[6];
+      length = pending[4] + pending[5];
+    }
+
+    if ((uint8_t)(length + lengthChecksum) != 0 || frameLength == 0) {
+      LOG_DEBUG(LogChannelSerial, "Simulator: bad LCS\n");
+      pending.erase(pending.begin(), pending.begin() + 2);
+      continue;
+    }
+
+    if (pending.size() < headerSize + frameLength + 1) return; // + DCS
+
+    const uint8_t *frame = pending.data() + headerSize;
+    uint8_t checksum = 0;
+    for (size_t i = 0; i <= frameLength; i++) checksum += frame[i];
+
+    if (checksum != 0 || frame[0] != 0xD4) {
+      LOG_DEBUG(LogChannelSerial, "Simulator: bad DCS or TFI\n");
+    } else {
+      output->insert(output->end(), ackFrame, ackFrame + sizeof(ackFrame));
+      handleFrame(frame + 1, frameLength - 1, output);
+    }
+
+    pending.erase(pending.begin(), pending.begin() + headerSize + frameLength + 1);
+  }
+}
+
+void PN532Simulator::respond(const uint8_t *data, size_t dataSize, std::deque<uint8_t> *output) {
+  uint8_t frame[PN532_MAX_FRAME_SIZE];
+  int frameSize = pn532EncodeFrame(0xD5, data, dataSize, frame, sizeof(frame));
+  if (frameSize < 0) return;
+
+  output->insert(output->end(), frame, frame + frameSize);
+}
+
+void PN532Simulator::handleFrame(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output) {
+  if (commandSize == 0) return;
+
+  commands++;
+
+  // The chip rejects commands with the wrong number of parameters the same way
+  if (!pn532CommandSizeValid(command[0], commandSize)) {
+    LOG_DEBUG(LogChannelCommand, "Simulator: bad command %X, %d bytes\n", command[0], (int)commandSize);
+    output->insert(output->end(), errorFrame, errorFrame + sizeof(errorFrame));
+    return;
+  }
+
+  switch (command[0]) {
+  case PN532::TxGetFirmwareVersion:
+    return getFirmwareVersion(command, commandSize, output);
+
+  case PN532::TxReadRegister:
+    return readRegister(command, commandSize, output);
+
+  case PN532::TxWriteRegister:
+    return writeRegister(command, commandSize, output);
+
+  case PN532::TxSetSerialBaudRate:
+    return setSerialBaudRate(command, commandSize, output);
+
+  case PN532::TxSetParameters:
+  case PN532::TxSAMConfiguration: {
+    uint8_t response[] = { (uint8_t)(command[0] + 1) };
+    return respond(response, sizeof(response), output);
+  }
+
+  case PN532::TxRFConfiguration:
+    return rfConfiguration(command, commandSize, output);
+
+  case PN532::TxInListPassiveTarget:
+    return inListPassiveTarget(command, commandSize, output);
+
+  case PN532::TxInDataExchange:
+    return inDataExchange(command, commandSize, output);
+
+  case PN532::TxInCommunicateThrough:
+    return inCommunicateThrough(command, commandSize, output);
+
+  case PN532::TxTgInitAsTarget:
+    tagActive = false;
+    return nextInitiatorCommand(PN532::RxTgInitAsTarget, output);
+
+  case PN532::TxTgGetInitiatorCommand:
+    return nextInitiatorCommand(PN532::RxTgGetInitiatorCommand, output);
+
+  case PN532::TxTgResponseToInitiator:
+    return tgResponseToInitiator(command, commandSize, output);
+
+  default:
+    LOG_DEBUG(LogChannelCommand, "Simulator: unsupported command %X\n", command[0]);
+    output->insert(output->end(), errorFrame, errorFrame + sizeof(errorFrame));
+    return;
+  }
+}
+
+void PN532Simulator::getFirmwareVersion(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output) {
+  uint8_t response[1 + sizeof(firmwareVersion)] = { PN532::RxGetFirmwareVersion };
+  memcpy(response + 1, firmwareVersion, sizeof(firmwareVersion));
+  respond(response, sizeof(response), output);
+}
+
+void PN532Simulator::readRegister(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output) {
+  uint8_t response[PN532_NORMAL_FRAME_MAX_LENGTH] = { PN532::RxReadRegister };
+  size_t responseSize = 1;
+
+  for (size_t i = 1; i + 1 < commandSize && responseSize < sizeof(response); i += 2) {
+    response[responseSize++] = registerValue(command[i] << 8 | command[i + 1]);
+  }
+
+  respond(response, responseSize, output);
+}
+
+void PN532Simulator::writeRegister(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output) {
+  for (size_t i = 1; i + 2 < commandSize; i += 3) {
+    if (command[i] == 0x63) registers[command[i + 1]] = command[i + 2];
+  }
+
+  uint8_t response[] = { PN532::RxWriteRegister };
+  respond(response, sizeof(response), output);
+}
+
+void PN532Simulator::setSerialBaudRate(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output) {
+  if (commandSize < 2 || command[1] >= sizeof(serialBaudRates) / sizeof(serialBaudRates[0]) || serialBaudRates[command[1]] > maxBaudRate) {
+    output->insert(output->end(), errorFrame, errorFrame + sizeof(errorFrame));
+    return;
+  }
+
+  // Answered at the old rate, the switch waits for the host's ACK
+  pendingBaudRate = serialBaudRates[command[1]];
+
+  uint8_t response[] = { PN532::RxSetSerialBaudRate };
+  respond(response, sizeof(response), output);
+}
+
+void PN532Simulator::rfConfiguration(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output) {
+  if (commandSize >= 3 && command[1] == 0x01) { // RF field
+    uint8_t &txControl = registers[PN532::RegisterCIU_TxControl & 0xFF];
+    txControl = command[2] & 0x01 ? txControl | 0x03 : txControl & ~0x03; // Tx1RFEn, Tx2RFEn
+  } else if (commandSize >= 5 && command[1] == 0x05) { // Max retries
+    passiveActivationRetries = command[4];
+  }
+
+  uint8_t response[] = { PN532::RxRFConfiguration };
+  respond(response, sizeof(response), output);
+}
+
+int PN532Simulator::transceiveTag(NTAG2xxEmulator *tag, const uint8_t *tx, size_t txSize, uint8_t *rx, size_t rxSize) {
+  if (!tag) return 0;
+
+  NTAG2xxResponse response;
+  tag->handleCommand(tx, txSize, &response);
+  if (!response.frame) return 0;
+
+  // The emulator answers with the TgResponseToInitiator frame it would hand a real PN532
+  PN532FrameHeader header;
+  if (pn532DecodeFrameHeader(response.frame, response.frameSize, &header) < PN532FrameNormal || header.length < 2) return 0;
+
+  size_t size = header.length - 2; // TFI, TgResponseToInitiator
+  if (size > rxSize) size = rxSize;
+  memcpy(rx, response.frame + header.tfiOffset + 2, size);
+  return size;
+}
+
+int PN532Simulator::answerFieldTag(FieldTag *fieldTag, const uint8_t *tx, size_t txSize, uint8_t *rx, size_t rxSize, int *firstBit) {
+  *firstBit = 0;
+
+  if (txSize == 1 && (tx[0] == PN532::NTAG21xRequest || tx[0] == PN532::NTAG21xWakeUp)) {
+    int received = transceiveTag(fieldTag->tag, tx, txSize, rx, rxSize);
+    fieldTag->state = received ? FieldReady : FieldIdle;
+    return received;
+  }
+
+  bool select = txSize >= 2 && (tx[0] == selectCodes[0] || tx[0] == selectCodes[1] || tx[0] == selectCodes[2]);
+  if (!select) {
+    // HLTA, READ and the rest are for the selected tag only
+    if (fieldTag->state != FieldActive) return 0;
+    if (tx[0] == PN532::NTAG21xHalt) fieldTag->state = FieldIdle;
+    return transceiveTag(fieldTag->tag, tx, txSize, rx, rxSize);
+  }
+
+  if (fieldTag->state != FieldReady) return 0;
+
+  if (tx[1] == 0x70) { // SELECT: the tag named answers with its SAK, the rest drop out
+    int received = transceiveTag(fieldTag->tag, tx, txSize, rx, rxSize);
+    if (!received) fieldTag->state = FieldIdle;
+    else if (!(rx[0] & ISO14443A_SAK_CASCADE)) fieldTag->state = FieldActive;
+    return received;
+  }
+
+  // ANTICOLLISION. The emulator only answers NVB 0x20, so partial UID parts
+  // are matched here against its whole one
+  uint8_t part[5];
+  const uint8_t anticollision[] = { tx[0], 0x20 };
+  if (transceiveTag(fieldTag->tag, anticollision, sizeof(anticollision), part, sizeof(part)) != 5) return 0;
+
+  int knownBits = ((tx[1] >> 4) - 2) * 8 + (tx[1] & 0x07);
+  if (knownBits < 0 || knownBits >= 40 || txSize < 2 + (size_t)(knownBits + 7) / 8) return 0;
+
+  for (int bit = 0; bit < knownBits; bit++) {
+    if ((part[bit / 8] ^ tx[2 + bit / 8]) & (1 << (bit % 8))) return 0; // Not this tag's UID
+  }
+
+  // The rest of the UID part + BCC, from the first unknown bit on
+  size_t size = 5 - knownBits / 8;
+  if (size > rxSize) size = rxSize;
+  memcpy(rx, part + knownBits / 8, size);
+  *firstBit = knownBits % 8;
+  return size;
+}
+
+int PN532Simulator::transceiveField(const uint8_t *tx, size_t txSize, uint8_t rxAlign, uint8_t *rx, size_t rxSize, int *collisionBit) {
+  *collisionBit = -1;
+  memset(rx, 0, rxSize);
+  size_t receivedBits = 0; // Counted from bit 0 of rx[0]
+
+  for (FieldTag &fieldTag : field) {
+    uint8_t answer[PN532_MAX_FRAME_SIZE];
+    int firstBit;
+    int answerSize = answerFieldTag(&fieldTag, tx, txSize, answer, sizeof(answer), &firstBit);
+    if (answerSize <= 0) continue;
+
+    // Load modulation adds up: a bit reads 1 if any tag sent a 1, and the
+    // first bit where the tags disagree is where the CIU sees the collision
+    size_t answerBits = answerSize * 8 - firstBit;
+    for (size_t i = 0; i < answerBits && (rxAlign + i) / 8 < rxSize; i++) {
+      size_t from = firstBit + i;
+      size_t to = rxAlign + i;
+      bool one = answer[from / 8] & (1 << (from % 8));
+      uint8_t mask = 1 << (to % 8);
+
+      bool disagree = to < receivedBits && one != ((rx[to / 8] & mask) != 0);
+      if (disagree && (*collisionBit < 0 || (int)to < *collisionBit)) *collisionBit = to;
+      if (one) rx[to / 8] |= mask;
+    }
+
+    if (rxAlign + answerBits > receivedBits) receivedBits = rxAlign + answerBits;
+  }
+
+  size_t received = (receivedBits + 7) / 8;
+  return received < rxSize ? received : rxSize;
+}
+
+int PN532Simulator::activateTag(uint8_t *atqa, uint8_t *sak, uint8_t *uid) {
+  NTAG2xxEmulator *tag = field.empty() ? NULL : field[0].tag;
+  uint8_t rx[5];
+
+  const uint8_t wupa = PN532::NTAG21xWakeUp;
+  if (transceiveTag(tag, &wupa, 1, rx, sizeof(rx)) != 2) return 0;
+  memcpy(atqa, rx, 2);
+
+  int uidSize = 0;
+  for (int level = 0; level < 3; level++) {
+    const uint8_t anticollision[] = { selectCodes[level], 0x20 };
+    if (transceiveTag(tag, anticollision, sizeof(anticollision), rx, sizeof(rx)) != 5) return 0;
+
+    uint8_t select[9] = { selectCodes[level], 0x70 };
+    memcpy(select + 2, rx, 5);
+    iso14443aCRCAppend(select, sizeof(select));
+
+    if (transceiveTag(tag, select, sizeof(select), rx, sizeof(rx)) != 3) return 0;
+    *sak = rx[0];
+
+    if (!(*sak & ISO14443A_SAK_CASCADE)) {
+      field[0].state = FieldActive;
+      memcpy(uid + uidSize, select + 2, 4);
+      return uidSize + 4;
+    }
+
+    memcpy(uid + uidSize, select + 3, 3); // Skip the cascade tag
+    uidSize += 3;
+  }
+
+  return 0;
+}
+
+void PN532Simulator::inListPassiveTarget(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output) {
+  if (commandSize < 3 || command[2] != PN532::TypeABaudRate) {
+    output->insert(output->end(), errorFrame, errorFrame + sizeof(errorFrame));
+    return;
+  }
+
+  uint8_t atqa[2], sak, uid[ISO14443A_MAX_UID_SIZE];
+  int uidSize = activateTag(atqa, &sak, uid);
+  tagActive = uidSize > 0;
+
+  if (!tagActive) {
+    // With infinite retries the real chip keeps polling and never answers
+    if (passiveActivationRetries == 0xFF) return;
+
+    uint8_t response[] = { PN532::RxInListPassiveTarget, 0 };
+    return respond(response, sizeof(response), output);
+  }
+
+  // NbTg, Tg, SENS_RES (MSB first, unlike the air), SEL_RES, NFCIDLength, NFCID
+  uint8_t response[7 + ISO14443A_MAX_UID_SIZE] = { PN532::RxInListPassiveTarget, 1, 1, atqa[1], atqa[0], sak, (uint8_t)uidSize };
+  memcpy(response + 7, uid, uidSize);
+  respond(response, 7 + uidSize, output);
+}
+
+void PN532Simulator::inDataExchange(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output) {
+  uint8_t response[2 + PN532_MAX_FRAME_SIZE] = { PN532::RxInDataExchange, 0x00 };
+  int received = 0;
+
+  if (commandSize >= 3 && command[1] == 1 && tagActive) {
+    // The chip adds and checks CRC_A itself here
+    received = transceiveTag(field[0].tag, command + 2, commandSize - 2, response + 2, sizeof(response) - 2);
+    if (received >= 3 && iso14443aCRCCheck(response + 2, received)) received -= 2;
+  }
+
+  if (received == 0) {
+    response[1] = 0x01; // Timeout
+    tagActive = false;
+  }
+
+  // 4-bit ACK/NAK answers come through as one data byte
+  respond(response, 2 + received, output);
+}
+
+void PN532Simulator::inCommunicateThrough(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output) {
+  uint8_t tx[PN532_MAX_FRAME_SIZE];
+  size_t txSize = commandSize - 1;
+  if (txSize + 2 > sizeof(tx)) txSize = sizeof(tx) - 2;
+  memcpy(tx, command + 1, txSize);
+
+  // Whatever TxMode/RxMode say about CRC_A. TxLastBits needs no handling,
+  // the tags go by NVB, and answers are placed at RxAlign
+  if (registers[PN532::RegisterCIU_TxMode & 0xFF] & 0x80) {
+    txSize += 2;
+    iso14443aCRCAppend(tx, txSize);
+  }
+  uint8_t rxAlign = (registers[PN532::RegisterCIU_BitFraming & 0xFF] >> 4) & 0x07;
+
+  uint8_t response[2 + PN532_MAX_FRAME_SIZE] = { PN532::RxInCommunicateThrough, 0x00 };
+  int collisionBit;
+  int received = transceiveField(tx, txSize, rxAlign, response + 2, sizeof(response) - 2, &collisionBit);
+  if (collisionBit < 0 && (registers[PN532::RegisterCIU_RxMode & 0xFF] & 0x80) && received >= 3 && iso14443aCRCCheck(response + 2, received)) received -= 2;
+
+  // CollPos only counts to 32, later collisions leave it marked not valid
+  uint8_t &error = registers[PN532::RegisterCIU_Error & 0xFF];
+  uint8_t &coll = registers[PN532::RegisterCIU_Coll & 0xFF];
+  error = 0;
+  coll = 0xA0;
+  if (collisionBit >= 0) {
+    error = 0x08; // CollErr
+    if (collisionBit < 32) coll = 0x80 | ((collisionBit + 1) & 0x1F);
+    response[1] = 0x06; // Bit collision
+  } else if (received == 0) {
+    response[1] = 0x01; // Timeout
+  }
+
+  respond(response, 2 + received, output);
+}
+
+void PN532Simulator::nextInitiatorCommand(uint8_t responseCode, std::deque<uint8_t> *output) {
+  if (scriptPosition == script.size() && scriptPassesLeft > 1) {
+    scriptPosition = 0;
+    scriptPassesLeft--;
+  }
+
+  if (scriptPosition == script.size() || scriptPassesLeft <= 0) {
+    finished = true; // The initiator has gone, a real chip would wait forever
+    return;
+  }
+
+  const std::vector<uint8_t> &initiatorCommand = script[scriptPosition++];
+
+  // TgInitAsTarget starts with the activation mode (0x00 = Mifare framing, 106 kbps), TgGetInitiatorCommand with a status
+  uint8_t response[2 + PN532_MAX_FRAME_SIZE] = { responseCode, 0x00 };
+  size_t size = initiatorCommand.size() < PN532_MAX_FRAME_SIZE ? initiatorCommand.size() : PN532_MAX_FRAME_SIZE;
+  memcpy(response + 2, initiatorCommand.data(), size);
+  respond(response, 2 + size, output);
+
+  if (exchangeLog) {
+    deliveredOpcode = size ? initiatorCommand[0] : 0;
+    deliveredAt = monotonicNanoseconds();
+  }
+}
+
+void PN532Simulator::tgResponseToInitiator(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output) {
+  targetResponses++;
+  lastResponse.assign(command + 1, command + commandSize);
+
+  if (exchangeLog && deliveredAt) {
+    TargetExchange exchange = { deliveredOpcode, monotonicNanoseconds() - deliveredAt };
+    exchangeLog->push_back(exchange);
+    deliveredAt = 0;
+  }
+
+  uint8_t response[] = { PN532::RxTgResponseToInitiator, 0x00 };
+  respond(response, sizeof(response), output);
+}
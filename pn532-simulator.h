@@ -0,0 +1,137 @@
+#ifndef PN532_SIMULATOR_H
+#define PN532_SIMULATOR_H
+
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+#include <deque>
+#include <vector>
+
+class NTAG2xxEmulator;
+
+// Software PN532 on the far side of a PN532MemoryTransport. Speaks HSU
+// framing (preamble, ACK, LCS/DCS) and answers the commands this library
+// sends, so everything above the transport runs unchanged without hardware.
+//
+// Initiator mode works against NTAG2xxEmulators standing in for the tags in
+// the field. Target mode plays back a script of initiator commands and
+// collects what the host answers to them.
+//
+// Like the real chip it powers up asleep, only listens at its current HSU
+// rate and drops frames with bad checksums. There is no RF timing: every
+// answer is ready as soon as the command is written
+class PN532Simulator {
+public:
+  PN532Simulator();
+
+  // Host bytes in; ACKs and responses are appended to output
+  void receive(const uint8_t *data, size_t size, std::deque<uint8_t> *output);
+  // The host moved its end of the link. Nothing gets through while the rates differ
+  void setHostBaudRate(int baudRate);
+  // Fastest SetSerialBaudRate to accept, like a board with a slow level shifter
+  void setMaxBaudRate(int baudRate) { maxBaudRate = baudRate; }
+  // Skip the wake-up preamble, e.g. to model a restart with the chip still up
+  void setAwake(bool awake) { this->awake = awake; }
+
+  // Tag in the field in initiator mode, NULL = empty field. Not owned
+  void setTag(NTAG2xxEmulator *tag);
+  // Another tag in the field. InCommunicateThrough reaches all of them at
+  // once and reports bit collisions the way the CIU does. InListPassiveTarget
+  // and InDataExchange only ever talk to the first
+  void addTag(NTAG2xxEmulator *tag);
+
+  // Commands handed out by TgInitAsTarget/TgGetInitiatorCommand in target
+  // mode, exactly as the PN532 would receive them over the air (so with
+  // CRC_A once the host has turned CRC off). The script runs passes times
+  void setInitiatorScript(const std::vector<std::vector<uint8_t>> &commands, int passes = 1);
+  // The script has run out and the host is waiting for a command that will
+  // never come. PN532MemoryTransport reports this as a read error
+  bool isFinished() const { return finished; }
+
+  // One initiator command handed to the host and answered
+  struct TargetExchange {
+    uint8_t opcode;
+    uint64_t nanoseconds; // From handing out the command until its TgResponseToInitiator arrived
+  };
+
+  // Appends every answered initiator command to exchanges (NULL to stop).
+  // Commands the host stays silent on are not included. Not owned
+  void setExchangeLog(std::vector<TargetExchange> *exchanges) { exchangeLog = exchanges; }
+
+  // Host commands answered so far, ACKs not included
+  int commandCount() const { return commands; }
+  // TgResponseToInitiator calls, and the data (CRC_A included) of the last one
+  int targetResponseCount() const { return targetResponses; }
+  const std::vector<uint8_t> &lastTargetResponse() const { return lastResponse; }
+
+  uint8_t registerValue(uint16_t address) const;
+
+private:
+  void handleFrame(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output);
+  void respond(const uint8_t *data, size_t dataSize, std::deque<uint8_t> *output);
+
+  void getFirmwareVersion(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output);
+  void readRegister(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output);
+  void writeRegister(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output);
+  void setSerialBaudRate(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output);
+  void rfConfiguration(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output);
+  void inListPassiveTarget(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output);
+  void inDataExchange(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output);
+  void inCommunicateThrough(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output);
+  void nextInitiatorCommand(uint8_t responseCode, std::deque<uint8_t> *output);
+  void tgResponseToInitiator(const uint8_t *command, size_t commandSize, std::deque<uint8_t> *output);
+
+  // Where a tag is in ISO/IEC 14443-3 activation. Halting is left to the emulator
+  enum FieldState {
+    FieldIdle,
+    FieldReady, // Answered REQA/WUPA, taking part in anticollision
+    FieldActive, // Selected
+  };
+
+  struct FieldTag {
+    NTAG2xxEmulator *tag;
+    FieldState state;
+  };
+
+  // One exchange with a tag. Returns the bytes it answered with (0 = silence)
+  int transceiveTag(NTAG2xxEmulator *tag, const uint8_t *tx, size_t txSize, uint8_t *rx, size_t rxSize);
+  // What one tag in the field answers to tx, going by its state. The answer
+  // starts at bit firstBit of rx, anticollision frames start mid-byte
+  int answerFieldTag(FieldTag *fieldTag, const uint8_t *tx, size_t txSize, uint8_t *rx, size_t rxSize, int *firstBit);
+  // One exchange with every tag in the field, the answers laid over each
+  // other starting at bit rxAlign of rx[0]. Returns the bytes received and
+  // sets collisionBit to the first bit the tags disagreed on, or -1
+  int transceiveField(const uint8_t *tx, size_t txSize, uint8_t rxAlign, uint8_t *rx, size_t rxSize, int *collisionBit);
+  // WUPA, anticollision and select. Returns the UID size, 0 if nobody answered
+  int activateTag(uint8_t *atqa, uint8_t *sak, uint8_t *uid);
+
+  std::vector<uint8_t> pending; // Host bytes not yet part of a complete frame
+  bool awake;
+  int baudRate; // The chip's HSU rate
+  int hostBaudRate;
+  int pendingBaudRate; // Taken on once the host ACKs SetSerialBaudRate, 0 = none
+  int maxBaudRate;
+
+  uint8_t registers[256]; // CIU, 0x6300-0x63FF
+  uint8_t passiveActivationRetries;
+
+  std::vector<FieldTag> field;
+  bool tagActive; // Selected by InListPassiveTarget, so InDataExchange reaches it
+
+  std::vector<std::vector<uint8_t>> script;
+  size_t scriptPosition;
+  int scriptPassesLeft;
+  bool finished;
+  uint8_t deliveredOpcode;
+  uint64_t deliveredAt; // 0 = answered already
+  std::vector<TargetExchange> *exchangeLog;
+
+  int commands;
+  int targetResponses;
+  std::vector<uint8_t> lastResponse;
+};
+
+#endif
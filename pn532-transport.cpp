@@ -0,0 +1,356 @@
+#include "pn532-transport.h"
+#include "logger.h"
+#include "pn532-simulator.h"
+#include "pn532.h"
+#include "time-utils.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <libserialport.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef linux
+#define SP_MODE_READ_WRITE (sp_mode)(SP_MODE_READ | SP_MODE_WRITE)
+#endif
+
+PN532FdTransport::PN532FdTransport() {
+  fd = -1;
+  closed = false;
+
+  // Nonblocking, so close can never stall on a full pipe
+  if (pipe(wakeFds) < 0) {
+    printf("Could not create wake-up pipe: %s\n", strerror(errno));
+    wakeFds[0] = wakeFds[1] = -1;
+    return;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(wakeFds[i], F_SETFL, fcntl(wakeFds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(wakeFds[i], F_SETFD, FD_CLOEXEC);
+  }
+}
+
+PN532FdTransport::~PN532FdTransport() {
+  for (int i = 0; i < 2; i++) {
+    if (wakeFds[i] >= 0) ::close(wakeFds[i]);
+  }
+}
+
+void PN532FdTransport::close() {
+  closed = true;
+
+  if (wakeFds[1] >= 0) {
+    const uint8_t wake = 0;
+    ssize_t written = ::write(wakeFds[1], &wake, 1);
+    (void)written; // Full already means a wake-up is pending
+  }
+}
+
+int PN532FdTransport::waitForInput(uint64_t deadline) {
+  // deadline = 0 waits indefinitely
+  while (true) {
+    if (closed) return -1;
+
+    // Negative descriptors are skipped by poll
+    struct pollfd descriptors[2] = { { fd, POLLIN, 0 }, { wakeFds[0], POLLIN, 0 } };
+    struct pollfd &descriptor = descriptors[0];
+    int ready;
+
+    if (deadline) {
+      uint64_t now = monotonicNanoseconds();
+      if (now >= deadline) return 0;
+
+      uint64_t remaining = deadline - now;
+#ifdef linux
+      struct timespec waitTime = { (time_t)(remaining / 1000000000), (long)(remaining % 1000000000) };
+      ready = ppoll(descriptors, 2, &waitTime, NULL);
+#else
+      ready = poll(descriptors, 2, (int)((remaining + 999999) / 1000000)); // Round up so we never wake early
+#endif
+    } else {
+      ready = poll(descriptors, 2, -1);
+    }
+
+    if (ready < 0) {
+      if (errno == EINTR) continue; // Checks closed on the way round
+
+      LOG_INFO(LogChannelSerial, "Poll error %d\n", errno);
+      return -1;
+    }
+
+    if (ready > 0) {
+      if (closed) return -1; // Woken by close
+      if (descriptor.revents & POLLIN) return 1;
+      if (!descriptor.revents) continue;
+
+      LOG_INFO(LogChannelSerial, "Port error: %X\n", descriptor.revents);
+      return -1;
+    }
+  }
+}
+
+PN532SerialTransport::PN532SerialTransport() {
+  port = NULL;
+}
+
+PN532SerialTransport::~PN532SerialTransport() {
+  release();
+}
+
+int PN532SerialTransport::open(const char *portName) {
+  if (sp_get_port_by_name(portName, &port)) {
+    printf("Could not open port\n");
+    port = NULL;
+    return -1;
+  }
+
+  if (sp_open(port, SP_MODE_READ_WRITE) != SP_OK) {
+    printf("Could not open port\n");
+    sp_free_port(port);
+    port = NULL;
+    return -1;
+  }
+
+  if (setBaudRate(PN532_DEFAULT_BAUD_RATE) < 0) {
+    printf("Could not set baud\n");
+    release();
+    return -1;
+  }
+
+  if (sp_set_bits(port, 8) != SP_OK) {
+    printf("Could not set data bit\n");
+    release();
+    return -1;
+  }
+
+  if (sp_set_parity(port, SP_PARITY_NONE) != SP_OK) {
+    printf("Could not set parity bit\n");
+    release();
+    return -1;
+  }
+
+  if (sp_set_stopbits(port, 1) != SP_OK) {
+    printf("Could not set stop bits\n");
+    release();
+    return -1;
+  }
+
+  if (sp_get_port_handle(port, &fd) != SP_OK) {
+    printf("Could not get port handle\n");
+    release();
+    return -1;
+  }
+
+  return 0;
+}
+
+int PN532SerialTransport::write(const uint8_t *data, size_t size) {
+  if (closed || !port) return -1;
+  return sp_blocking_write(port, data, size, 10000) != (int)size ? -1 : 0;
+}
+
+int PN532SerialTransport::read(uint8_t *buffer, size_t size) {
+  if (closed || !port) return -1;
+  return sp_nonblocking_read(port, buffer, size);
+}
+
+int PN532SerialTransport::setBaudRate(int baudRate) {
+  return sp_set_baudrate(port, baudRate) != SP_OK ? -1 : 0;
+}
+
+void PN532SerialTransport::drain() {
+  if (port) sp_drain(port);
+}
+
+void PN532SerialTransport::flushInput() {
+  if (port) sp_flush(port, SP_BUF_INPUT);
+}
+
+void PN532SerialTransport::release() {
+  if (port) {
+    sp_close(port);
+    sp_free_port(port);
+    port = NULL;
+  }
+  fd = -1;
+}
+
+static speed_t termiosSpeed(int baudRate) {
+  switch (baudRate) {
+  case 9600: return B9600;
+  case 19200: return B19200;
+  case 38400: return B38400;
+  case 57600: return B57600;
+  case 115200: return B115200;
+  case 230400: return B230400;
+#ifdef B460800
+  case 460800: return B460800;
+#endif
+#ifdef B921600
+  case 921600: return B921600;
+#endif
+  default: return 0; // 1288000 has no termios constant
+  }
+}
+
+PN532PtyTransport::~PN532PtyTransport() {
+  release();
+}
+
+int PN532PtyTransport::open(const char *path) {
+  fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    printf("Could not open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  struct termios settings;
+  if (tcgetattr(fd, &settings) < 0) {
+    printf("%s is not a tty\n", path);
+    release();
+    return -1;
+  }
+
+  cfmakeraw(&settings);
+  settings.c_cflag |= CLOCAL | CREAD;
+  if (tcsetattr(fd, TCSANOW, &settings) < 0 || setBaudRate(PN532_DEFAULT_BAUD_RATE) < 0) {
+    printf("Could not configure %s\n", path);
+    release();
+    return -1;
+  }
+
+  return 0;
+}
+
+int PN532PtyTransport::write(const uint8_t *data, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    if (closed) return -1;
+
+    ssize_t result = ::write(fd, data + written, size - written);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+      struct pollfd descriptor = { fd, POLLOUT, 0 };
+      if (poll(&descriptor, 1, 10000) <= 0) return -1;
+      continue;
+    }
+
+    written += result;
+  }
+
+  return 0;
+}
+
+int PN532PtyTransport::read(uint8_t *buffer, size_t size) {
+  if (closed) return -1;
+
+  ssize_t result = ::read(fd, buffer, size);
+  if (result < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+  return result;
+}
+
+int PN532PtyTransport::setBaudRate(int baudRate) {
+  speed_t speed = termiosSpeed(baudRate);
+  if (!speed) return -1;
+
+  struct termios settings;
+  if (tcgetattr(fd, &settings) < 0) return -1;
+  cfsetispeed(&settings, speed);
+  cfsetospeed(&settings, speed);
+
+  return tcsetattr(fd, TCSANOW, &settings) < 0 ? -1 : 0;
+}
+
+void PN532PtyTransport::drain() {
+  if (fd >= 0) tcdrain(fd);
+}
+
+void PN532PtyTransport::flushInput() {
+  if (fd >= 0) tcflush(fd, TCIFLUSH);
+}
+
+void PN532PtyTransport::release() {
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+PN532MemoryTransport::PN532MemoryTransport(PN532Simulator *simulator) : simulator(simulator) {
+  closed = false;
+}
+
+int PN532MemoryTransport::write(const uint8_t *data, size_t size) {
+  if (closed) return -1;
+
+  simulator->receive(data, size, &input);
+  return 0;
+}
+
+int PN532MemoryTransport::read(uint8_t *buffer, size_t size) {
+  if (closed) return -1;
+
+  size_t count = input.size() < size ? input.size() : size;
+  std::copy(input.begin(), input.begin() + count, buffer);
+  input.erase(input.begin(), input.begin() + count);
+  return count;
+}
+
+int PN532MemoryTransport::waitForInput(uint64_t deadline) {
+  if (closed) return -1;
+  if (!input.empty()) return 1;
+
+  // Nothing will ever come: don't let a retry loop spin on timeouts
+  if (!deadline || simulator->isFinished()) return -1;
+
+  return 0;
+}
+
+int PN532MemoryTransport::setBaudRate(int baudRate) {
+  simulator->setHostBaudRate(baudRate);
+  return 0;
+}
+
+void PN532MemoryTransport::flushInput() {
+  input.clear();
+}
+
+// Owns the simulator it talks to, for "sim:"
+class PN532OwnedSimulatorTransport : public PN532MemoryTransport {
+public:
+  PN532OwnedSimulatorTransport(PN532Simulator *simulator) : PN532MemoryTransport(simulator), ownedSimulator(simulator) {}
+  ~PN532OwnedSimulatorTransport() { delete ownedSimulator; }
+
+private:
+  PN532Simulator *ownedSimulator;
+};
+
+PN532Transport *pn532OpenTransport(const char *name) {
+  if (strncmp(name, "sim:", 4) == 0) {
+    return new PN532OwnedSimulatorTransport(new PN532Simulator());
+  }
+
+  if (strncmp(name, "pty:", 4) == 0) {
+    PN532PtyTransport *transport = new PN532PtyTransport();
+    if (transport->open(name + 4) < 0) {
+      delete transport;
+      return NULL;
+    }
+    return transport;
+  }
+
+  PN532SerialTransport *transport = new PN532SerialTransport();
+  if (transport->open(name) < 0) {
+    delete transport;
+    return NULL;
+  }
+  return transport;
+}
@@ -0,0 +1,132 @@
+#ifndef PN532_TRANSPORT_H
+#define PN532_TRANSPORT_H
+
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+#include <atomic>
+#include <deque>
+
+struct sp_port;
+class PN532Simulator;
+
+// Byte pipe between PN532 and the chip. PN532 does all the framing; a
+// transport only moves bytes and waits for them
+class PN532Transport {
+public:
+  virtual ~PN532Transport() {}
+
+  // All of data, or -1
+  virtual int write(const uint8_t *data, size_t size) = 0;
+  // Whatever has arrived, without waiting. 0 = nothing yet, < 0 = error
+  virtual int read(uint8_t *buffer, size_t size) = 0;
+  // 1 once read has something, 0 at deadline (monotonic nanoseconds, 0 = no
+  // deadline), -1 on error or after close
+  virtual int waitForInput(uint64_t deadline) = 0;
+
+  // -1 if the rate is not supported
+  virtual int setBaudRate(int baudRate) = 0;
+  // Returns once everything written has gone out
+  virtual void drain() = 0;
+  // Drops anything received but not read yet
+  virtual void flushInput() = 0;
+  // Safe from a signal handler: wakes waitForInput and fails later calls.
+  // The device itself is released when the transport is destroyed
+  virtual void close() = 0;
+};
+
+// Transport on a file descriptor we can poll. close only sets a flag and
+// writes to a self-pipe that waitForInput polls alongside fd, both of which
+// are async-signal-safe
+class PN532FdTransport : public PN532Transport {
+public:
+  PN532FdTransport();
+  ~PN532FdTransport();
+
+  int waitForInput(uint64_t deadline) override;
+  void close() override;
+
+protected:
+  int fd;
+  std::atomic<bool> closed;
+
+private:
+  int wakeFds[2]; // Read end, write end. -1 if the pipe could not be made
+};
+
+// Serial port through libserialport: USB adapters and real UARTs
+class PN532SerialTransport : public PN532FdTransport {
+public:
+  PN532SerialTransport();
+  ~PN532SerialTransport();
+
+  int open(const char *portName);
+
+  int write(const uint8_t *data, size_t size) override;
+  int read(uint8_t *buffer, size_t size) override;
+  int setBaudRate(int baudRate) override;
+  void drain() override;
+  void flushInput() override;
+
+private:
+  // sp_close and sp_free_port, so never from a signal handler
+  void release();
+
+  struct sp_port *port;
+};
+
+// Any tty opened straight through termios. Pseudo terminals do not support
+// the modem control calls libserialport makes, so this is the way to talk to
+// a simulator or recorder in another process (e.g. through socat)
+class PN532PtyTransport : public PN532FdTransport {
+public:
+  ~PN532PtyTransport();
+
+  int open(const char *path);
+
+  int write(const uint8_t *data, size_t size) override;
+  int read(uint8_t *buffer, size_t size) override;
+  int setBaudRate(int baudRate) override;
+  void drain() override;
+  void flushInput() override;
+
+private:
+  void release();
+};
+
+// No I/O at all: every write goes straight into a PN532Simulator, and its
+// answers are queued up for read. Runs on one thread and never sleeps, so
+// protocol code can be timed without a reader or a kernel in the way
+class PN532MemoryTransport : public PN532Transport {
+public:
+  // simulator is not owned
+  PN532MemoryTransport(PN532Simulator *simulator);
+
+  int write(const uint8_t *data, size_t size) override;
+  int read(uint8_t *buffer, size_t size) override;
+  // Nothing can arrive while we wait, so an empty queue is an immediate
+  // timeout, or an error when the simulator will never answer again
+  int waitForInput(uint64_t deadline) override;
+  // Any rate works, but the simulator only hears us at the one it is on
+  int setBaudRate(int baudRate) override;
+  void drain() override {}
+  void flushInput() override;
+  void close() override { closed = true; }
+
+private:
+  PN532Simulator *simulator;
+  std::deque<uint8_t> input;
+  std::atomic<bool> closed;
+};
+
+// Opens the transport for a port name:
+//   pty:<path>  a tty through termios, see PN532PtyTransport
+//   sim:        an in-memory PN532Simulator with an empty field
+//   anything else is a serial port for libserialport
+// NULL if it could not be opened
+PN532Transport *pn532OpenTransport(const char *name);
+
+#endif
@@ -1,139 +1,154 @@
 #include "pn532.h"
+#include "frame-capture.h"
+#include "latency-histogram.h"
+#include "ntag2xx-emulation.h"
+#include "pn532-commands.h"
+#include "pn532-frame.h"
+#include "pn532-transport.h"
+#include "time-utils.h"
 
-#include <libserialport.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-#ifdef linux
-#define SP_MODE_READ_WRITE (sp_mode)(SP_MODE_READ | SP_MODE_WRITE)
-#endif
-
-#define DEBUGGING
-
+// DEBUGGING comes from the build (make DEBUG=1)
 #ifdef DEBUGGING
 #define MAX_RESPONSE_TIME 100 // Bigger time out when debugging
 #else
 #define MAX_RESPONSE_TIME 15 // (ms) defined by PN532 spec
 #endif
 
-#define RESPONSE_PREFIX_LENGTH 6
-
-int PN532::readSerialFrame(uint8_t *buffer, const size_t bufferSize, int timeout) {
-  time_t startTime;
-  time_t now;
-  time(&startTime);
-
-  log(LogChannelSerial, "Reading serial frame\n");
-
-  size_t expectedSize = 0;
-  while (readSize <= bufferSize) {
-    if (!expectedSize && readSize >= 4) {
-      // Byte 4 tells us the length
-      uint8_t length = serialBuffer[3];
-
-      switch (length) {
-      case 0: // Start of ACK code
-        if (readSize >= 5) {
-          if (serialBuffer[4] == 0xFF) { // End of ACK code
-            expectedSize = 6;
-          } else {
-            log(LogChannelSerial, "Received unknown frame code: %X\n", serialBuffer[4]);
-            return -1;
-          }
-        }
-        break;
-
-      case 0xFF: // Start of NACK code or Extended Information Frame code
-        if (readSize >= 5) {
-          uint8_t nextByte = serialBuffer[4];
-          switch (nextByte) {
-          case 0x00: // End of NACK code
-            expectedSize = 6;
-            break;
-
-          case 0xFF: // End of Extended Information Frame code
-            printf("*******TODO: Handle extended information frame*********\n");
-            return -1;
-
-          default:
-            log(LogChannelSerial, "Received unknown frame code: %X\n", nextByte);
-            return -1;
-          }
-        }
-        break;
-
-      case 0x01: // Error frame
-        expectedSize = 8;
-        break;
+#define MAX_COMMAND_ATTEMPTS 3 // Resends when neither an ACK nor a response comes back
 
-      default: // Information packet
-        expectedSize = length + 7; // Provided length + 7 bytes of frame overhead
-        break;
-      }
-    }
+// Fixed commands, framed at compile time
+static constexpr auto getFirmwareVersionFrame = pn532CommandFrame<PN532::TxGetFirmwareVersion>();
+static constexpr auto getInitiatorCommandFrame = pn532CommandFrame<PN532::TxTgGetInitiatorCommand>();
+static constexpr auto maxRetriesFrame = pn532CommandFrame<PN532::TxRFConfiguration>({
+  0x05, // Max Retries
+  0xFF, // MxRtyATR max retries for ATR_REQ
+  0xFF, // MxRtyPSL max retries for PSL_REQ
+  0xFF, // MxRtyPassiveActivation max retries in InListPassivetarget
+});
 
-    if (expectedSize) {
-      if (readSize >= expectedSize) {
-        if (serialBuffer[expectedSize - 1] != 0x00) {
-          log(LogChannelSerial, "Read incorrect postamble: %d\n", serialBuffer[expectedSize - 1]);
+int PN532::readSerialFrame(PN532Frame &frame, int timeout) {
+  //  0 = block indefinitely
+  // >0 = timeout (ms)
+  const uint64_t deadline = timeout > 0 ? monotonicNanoseconds() + (uint64_t)timeout * 1000000 : 0;
+
+  // The previous frame's view expires here
+  receiveBuffer.consume(frameInUseSize);
+  frameInUseSize = 0;
+  frame = PN532Frame();
+
+  LOG_TRACE(LogChannelSerial, "Reading serial frame\n");
+
+  // The decoder has seen the first decoded bytes of the ring. Noise and
+  // corrupt frames are dropped as soon as they show and the bytes after them
+  // rescanned, so a good frame behind them is not held up until the timeout
+  PN532FrameDecoder decoder;
+  size_t decoded = 0;
+  int skipped = 0;
+  while (true) {
+    size_t available = receiveBuffer.size();
+    size_t window = available < PN532_MAX_FRAME_SIZE ? available : PN532_MAX_FRAME_SIZE; // No frame is longer
+
+    // Dropping a byte moves bytes along instead of peeking again: the rest of the window stays contiguous
+    const uint8_t *bytes = receiveBuffer.peek(window);
+    while (decoded < window) {
+      size_t used;
+      PN532DecodeResult result = decoder.feed(bytes + decoded, window - decoded, &used);
+      decoded += used;
+      if (result == PN532DecodeMore) break;
+
+      if (result == PN532DecodeComplete) {
+        if (skipped) LOG_INFO(LogChannelSerial, "Skipped %d bytes before frame\n", skipped);
+        if (bytes[decoded - 1] != 0x00) {
+          LOG_INFO(LogChannelSerial, "Read incorrect postamble: %d\n", bytes[decoded - 1]);
         }
 
-        memcpy(buffer, serialBuffer, expectedSize); // Copy full expected frame into buffer
+        lastFrameNanoseconds = monotonicNanoseconds();
+        if (capture) capture->record(FrameCapturePN532ToHost, bytes, decoded);
 
-        if (readSize > expectedSize) {
-          if (serialBuffer[expectedSize] == 0x00) { // Probably started reading next frame
-            memcpy(serialBuffer, serialBuffer + expectedSize, readSize - expectedSize); // Move the rest of the data to the start of serialBuffer for the next read
-          }
-        }
+        // Any bytes after this frame stay in the ring for the next read
+        frame = PN532Frame(bytes, decoder.header());
+        frameInUseSize = decoded;
 
-        readSize = readSize - expectedSize; // Set readSize for next read
+        return decoded;
+      }
 
-        return expectedSize;
+      if (result == PN532DecodeBadLength) {
+        LOG_INFO(LogChannelSerial, "Bad frame length %X %X, resyncing\n", bytes[decoded - 2], bytes[decoded - 1]); // Last length byte and LCS
+      } else if (result == PN532DecodeBadChecksum) {
+        LOG_INFO(LogChannelSerial, "Bad data checksum in %d byte frame, resyncing\n", (int)decoded + 1);
       }
+
+      receiveBuffer.consume(1);
+      bytes++;
+      window--;
+      skipped++;
+      decoder.reset();
+      decoded = 0;
     }
 
-    // Read at end of loop in case we received 2 full frames last time
-    size_t lastRead = sp_nonblocking_read(port, serialBuffer + readSize, bufferSize - readSize);
-    readSize += lastRead;
-    if (lastRead < 0) {
-      log(LogChannelSerial, "Serial error %d\n", lastRead);
-      return lastRead;
+    int waitResult = transport->waitForInput(deadline);
+    if (waitResult < 0) {
+      receiveBuffer.clear();
+      return -1;
     }
 
-    if (serialBuffer[0] != 0x00) {
-      log(LogChannelSerial, "Received unknown start of frame: %X\n", serialBuffer[0]);
+    if (waitResult == 0 && decoded) {
+      // A LEN corrupted along with its LCS claims bytes that never come, and
+      // may have swallowed a real frame. Rescan what is buffered behind it
+      // before giving up. The deadline has passed, so the next wait returns at once
+      LOG_INFO(LogChannelSerial, "Frame cut short at %d bytes, resyncing\n", (int)decoded);
+      receiveBuffer.consume(1);
+      skipped++;
+      decoder.reset();
+      decoded = 0;
+      continue;
     }
 
-    time(&now);
-    if ((difftime(now, startTime) * 1000) > timeout) {
-      log(LogChannelSerial, "Timeout\n");
-      log(LogChannelSerial, "%d %d %d\n", expectedSize, lastRead, readSize);
-      printHex(serialBuffer, readSize, LogChannelSerial);
+    if (waitResult == 0) {
+      LOG_DEBUG(LogChannelSerial, "Timeout, skipped %d bytes\n", skipped);
+      receiveBuffer.clear();
+
+      return 0;
+    }
 
-      // If we timed out, we definitely didn't read part of the next frame
-      // So reset readSize to 0
-      int partialSize = readSize;
-      readSize = 0;
+    size_t space;
+    uint8_t *writePointer = receiveBuffer.writePointer(&space);
+    if (!space) {
+      LOG_INFO(LogChannelSerial, "Buffer full: %d\n", (int)receiveBuffer.size());
+      receiveBuffer.clear();
+      return -1;
+    }
 
-      return partialSize;
+    int lastRead = transport->read(writePointer, space);
+    if (lastRead < 0) {
+      LOG_INFO(LogChannelSerial, "Serial error %d\n", lastRead);
+      return lastRead;
     }
+    receiveBuffer.commitWrite(lastRead);
   }
-
-  log(LogChannelSerial, "Buffer full: %d > %d\n", readSize, bufferSize);
-  return readSize;
 }
 
 void PN532::printHex(const uint8_t buffer[], int size, LogChannel logChannel) {
-  for (int i = 0; i < size; i++) {
-    if (logChannel) {
-      log(logChannel, "%02X ", buffer[i]);
-    } else {
+  if (!logChannel) {
+    for (int i = 0; i < size; i++) {
       printf("%02X ", buffer[i]);
     }
+    printf("\n");
+    return;
+  }
+
+  // One log call per line so the channel prefix is printed once
+  char line[size * 3 + 1];
+  for (int i = 0; i < size; i++) {
+    snprintf(line + i * 3, 4, "%02X ", buffer[i]);
   }
-  printf("\n");
+  line[size * 3] = 0;
+  log(logChannel, "%s\n", line);
 }
 
 void PN532::printFrame(const uint8_t *frame, const size_t frameLength) {
@@ -142,24 +157,39 @@ void PN532::printFrame(const uint8_t *frame, const size_t frameLength) {
     return;
   }
 
-  if (frameLength == 6) { // Probably ACK
-    // TODO: Print ACK/NACK
-    // return;
-  }
+  PN532FrameHeader header;
+  switch (pn532DecodeFrameHeader(frame, frameLength, &header)) {
+  case PN532FrameAck:
+    printf("ACK\n");
+    return;
+
+  case PN532FrameNack:
+    printf("NACK\n");
+    return;
 
-  if (frameLength == 8) { // Probably error
+  case PN532FrameError:
     printf("Error!\n");
 
     printf("Error length: %d\n", frame[3]);
     printf("Error code: %X\n", frame[5]);
     return;
+
+  case PN532FrameNormal:
+  case PN532FrameExtended:
+    if (header.frameSize <= frameLength) break;
+    // Fall through
+
+  default:
+    printf("Incomplete frame\n");
+    return;
   }
 
-  printf("Frame:\n");
-  uint8_t dataLength = frame[3] - 1;
+  printf(header.type == PN532FrameExtended ? "Extended frame:\n" : "Frame:\n");
+  int dataLength = header.length - 1;
+  const uint8_t *packet = frame + header.tfiOffset + 1; // Command code followed by its parameters
 
   printf("Data length: %d\n", dataLength);
-  uint8_t direction = frame[5];
+  uint8_t direction = frame[header.tfiOffset];
   if (direction == 0xD4) {
     printf("Host -> PN532\n");
   } else if (direction == 0xD5) {
@@ -168,142 +198,105 @@ void PN532::printFrame(const uint8_t *frame, const size_t frameLength) {
     printf("Unknown direction: %d\n", direction);
   }
 
-  uint8_t frameType = frame[6];
+  uint8_t frameType = packet[0];
   printf("FrameType: %X\n", frameType);
 
+  const PN532CommandDescriptor *descriptor = pn532FindCommand(frameType);
+  if (!descriptor) {
+    printf("Unknown frame type: %X\n", frameType);
+    return;
+  }
+
+  printf("%s\n", descriptor->name);
+  if (direction == 0xD4 && !pn532CommandSizeValid(frameType, dataLength)) {
+    printf("Malformed: %d bytes, expected %d-%d\n", dataLength, descriptor->minSize, descriptor->maxSize);
+    return;
+  }
+
   switch (frameType) {
   case TxReadRegister:
-    printf("ReadRegister\n");
-    printf("Register: %X\n", frame[RESPONSE_PREFIX_LENGTH + 1]);
+    for (int i = 1; i + 1 < dataLength; i += 2) {
+      printf("Register: %02X%02X\n", packet[i], packet[i + 1]);
+    }
     break;
 
   case RxReadRegister:
-    printf("ReadRegister\n");
-    printf("Value: %X\n", frame[RESPONSE_PREFIX_LENGTH +1]);
+    printf("Values: ");
+    printHex(packet + 1, dataLength - 1);
     break;
 
   case TxWriteRegister:
-    printf("WriteRegister\n");
-    printf("Register: %X, value: %X\n", frame[RESPONSE_PREFIX_LENGTH + 1], frame[RESPONSE_PREFIX_LENGTH + 2]);
+    for (int i = 1; i + 2 < dataLength; i += 3) {
+      printf("Register: %02X%02X, value: %X\n", packet[i], packet[i + 1], packet[i + 2]);
+    }
     break;
 
   case RxWriteRegister:
-    printf("WriteRegister\n");
     printf("Success\n");
     break;
 
-  case TxInDataExchange:
-    printf("InDataExchange\n");
-    break;
-
   case RxInDataExchange:
-    printf("InDataExchange\n");
-    printf("Status: %X\n", frame[RESPONSE_PREFIX_LENGTH + 1]);
+  case RxInCommunicateThrough:
+    printf("Status: %X\n", packet[1]);
 
     printf("Data: ");
-    printHex(frame + RESPONSE_PREFIX_LENGTH + 2, dataLength - 2);
+    printHex(packet + 2, dataLength - 2);
     break;
 
   case TxInCommunicateThrough:
-    printf("InCommunicateThrough\n");
     printf("Sending data: ");
-    printHex(frame + RESPONSE_PREFIX_LENGTH + 1, dataLength - 1);
-    break;
-
-  case RxInCommunicateThrough:
-    printf("InCommunicateThrough\n");
-    printf("Status: %X\n", frame[RESPONSE_PREFIX_LENGTH + 1]);
-
-    printf("Data: ");
-    printHex(frame + RESPONSE_PREFIX_LENGTH + 2, dataLength - 2);
+    printHex(packet + 1, dataLength - 1);
     break;
 
   case RxInListPassiveTarget: {
-    printf("InListPassiveTarget\n");
-    uint8_t tagCount = frame[RESPONSE_PREFIX_LENGTH + 1];
+    uint8_t tagCount = packet[1];
     printf("%d tag\n", tagCount);
 
-    printf("Selected tag: %X\n", frame[RESPONSE_PREFIX_LENGTH + 2]);
-    printf("SENS_RES: %X %X\n", frame[RESPONSE_PREFIX_LENGTH + 3], frame[RESPONSE_PREFIX_LENGTH + 4]);
-    printf("SEL_RES: %X\n", frame[RESPONSE_PREFIX_LENGTH + 5]);
+    printf("Selected tag: %X\n", packet[2]);
+    printf("SENS_RES: %X %X\n", packet[3], packet[4]);
+    printf("SEL_RES: %X\n", packet[5]);
 
-    int idLen = frame[RESPONSE_PREFIX_LENGTH + 6];
+    int idLen = packet[6];
     printf("NFC ID Length: %d\n", idLen);
     printf("NFC ID: ");
-    printHex(frame + RESPONSE_PREFIX_LENGTH + 7, idLen);
+    printHex(packet + 7, idLen);
     break;
   }
 
-  case TxTgInitAsTarget:
-    printf("TgInitAsTarget\n");
-    break;
-
-  case RxTgInitAsTarget:
-    printf("TgInitastarget\n");
-    break;
-
-  case TxTgGetInitiatorCommand:
-    printf("TgGetInitiatorCommand\n");
-    break;
-
-  case RxTgGetInitiatorCommand:
-    printf("TgGetInitiatorCommand\n");
-    break;
-
-  case TxTgResponseToInitiator:
-    printf("TgResponseToInitiator\n");
-    break;
-
-  case RxTgResponseToInitiator:
-    printf("TgResponseToInitiator\n");
-    break;
-
   default:
-    printf("Unknown frame type: %X\n", frameType);
     break;
   }
 }
 
-PN532::PN532(const char* portName) {
-  if (sp_get_port_by_name(portName, &port)) {
-    printf("Could not open port\n");
-    exit(1);
-  }
+PN532::PN532(const char *portName) {
+  transport = pn532OpenTransport(portName);
+  if (!transport) exit(1);
 
-  if (sp_open(port, SP_MODE_READ_WRITE) != SP_OK) {
-    printf("Could not open port\n");
-    exit(1);
-  }
-
-  if (sp_set_baudrate(port, 115200) != SP_OK) {
-    printf("Could not set baud\n");
-    exit(1);
-  }
-
-  if (sp_set_bits(port, 8) != SP_OK) {
-    printf("Could not set data bit\n");
-    exit(1);
-  }
-
-  if (sp_set_parity(port, SP_PARITY_NONE) != SP_OK) {
-    printf("Could not set parity bit\n");
-    exit(1);
-  }
+  init();
+}
 
-  if (sp_set_stopbits(port, 1) != SP_OK) {
-    printf("Coulld not set stop bits\n");
-    exit(1);
-  }
+PN532::PN532(PN532Transport *transport) : transport(transport) {
+  init();
+}
 
+void PN532::init() {
+  serialBaudRate = PN532_DEFAULT_BAUD_RATE;
+  capture = NULL;
+  latencyStats = NULL;
+  lastFrameNanoseconds = 0;
+  commandsSent = 0;
   shouldQuit = false;
-  readSize = 0;
+  frameInUseSize = 0;
+  registerCacheValid = 0;
 }
 
 int PN532::wakeUp() {
+  invalidateRegisterCache(); // The chip may have been reset while asleep
+
   const int wakeBufferSize = 16;
   uint8_t wakeBuffer[wakeBufferSize] = { 0x55, 0x55, 0x00, 0x00, 0x00, 00, 00, 00, 00, 00, 00, 00, 00, 00, 00, 00 };
 
-  if ((int)sp_blocking_write(port, wakeBuffer, wakeBufferSize, 10000) != wakeBufferSize) {
+  if (transport->write(wakeBuffer, wakeBufferSize) < 0) {
     printf("Error waking\n");
     return -1;
   }
@@ -311,10 +304,7 @@ int PN532::wakeUp() {
   printf("\nWoke device\n");
 
   printf("\nFetching firmware version\n");
-  const int responseBufferSize = 13;
-  uint8_t responseBuffer[responseBufferSize];
-  uint8_t command[1] = { TxGetFirmwareVersion };
-  if (sendCommand(command, 1, responseBuffer, responseBufferSize, MAX_RESPONSE_TIME) < 0) {
+  if (getFirmwareVersion() < 0) {
     printf("Could not get firmware version\n");
     return -1;
   }
@@ -322,59 +312,136 @@ int PN532::wakeUp() {
   return 0;
 }
 
+int PN532::getFirmwareVersion() {
+  PN532Frame response;
+  int responseSize = sendEncodedCommand(getFirmwareVersionFrame.bytes, getFirmwareVersionFrame.size(), response, MAX_RESPONSE_TIME);
+  if (responseSize <= 0 || response.command() != RxGetFirmwareVersion) return -1;
+
+  return 0;
+}
+
+// SetSerialBaudRate codes, fastest first
+static const struct {
+  int baudRate;
+  uint8_t code;
+} serialBaudRates[] = {
+  { 1288000, 0x08 },
+  { 921600, 0x07 },
+  { 460800, 0x06 },
+  { 230400, 0x05 },
+  { 115200, 0x04 },
+};
+
+int PN532::negotiateBaudRate(int maxBaudRate) {
+  for (size_t i = 0; i < sizeof(serialBaudRates) / sizeof(serialBaudRates[0]); i++) {
+    int baudRate = serialBaudRates[i].baudRate;
+    if (baudRate > maxBaudRate) continue;
+    if (baudRate <= serialBaudRate) break; // Nothing faster worked
+
+    // Don't ask the PN532 for a rate the host adapter cannot follow
+    int previousBaudRate = serialBaudRate;
+    if (setHostBaudRate(baudRate) < 0) continue;
+    setHostBaudRate(previousBaudRate);
+
+    if (switchBaudRate(baudRate, serialBaudRates[i].code) == 0) {
+      printf("Serial link at %d baud\n", baudRate);
+      return 0;
+    }
+
+    // Either the PN532 never switched, or it did and the link is unusable at the new rate
+    setHostBaudRate(previousBaudRate);
+    if (getFirmwareVersion() < 0) {
+      printf("Lost the PN532 after switching to %d baud\n", baudRate);
+      return -1;
+    }
+    printf("Could not use %d baud\n", baudRate);
+  }
+
+  return 0;
+}
+
+int PN532::switchBaudRate(int baudRate, uint8_t baudRateCode) {
+  static constexpr auto baudRateFrame = pn532CommandFrame<TxSetSerialBaudRate>({ 0x00 });
+  auto frame = baudRateFrame;
+  frame.set(1, baudRateCode);
+
+  PN532Frame response;
+  int responseSize = sendEncodedCommand(frame.bytes, frame.size(), response, MAX_RESPONSE_TIME);
+  if (responseSize <= 0 || response.command() != RxSetSerialBaudRate) return -1;
+
+  // The PN532 changes rate once we acknowledge its answer, which still goes out at the old one
+  static const uint8_t ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+  if (sendFrame(ack, sizeof(ack)) < 0) return -1;
+  transport->drain();
+
+  struct timespec switchTime = { 0, 1000000 }; // Give the chip time to retune its UART
+  nanosleep(&switchTime, NULL);
+
+  if (setHostBaudRate(baudRate) < 0) return -1;
+
+  return getFirmwareVersion();
+}
+
+int PN532::setHostBaudRate(int baudRate) {
+  if (transport->setBaudRate(baudRate) < 0) return -1;
+
+  // Anything half received belongs to the old rate
+  transport->flushInput();
+  receiveBuffer.clear();
+  frameInUseSize = 0;
+
+  serialBaudRate = baudRate;
+  return 0;
+}
+
 int PN532::setUp(SetupMode mode) {
   printf("Setting up\n");
+  return configure(mode);
+}
+
+// Each command waits for its ACK and response before the next goes out: the
+// PN532 runs one command at a time, and a frame arriving mid-command aborts it
+int PN532::configure(SetupMode mode) {
+  if (configureFirmware() < 0) return -1;
+  return configureMode(mode);
+}
+
+int PN532::configureFirmware() {
   if (samConfig(SamConfigurationModeNormal) < 0) {
     printf("Error SAM config\n");
     return -1;
   }
 
-  const int responseBufferSize = 50;
-  uint8_t responseBuffer[responseBufferSize];
-
-  const int parameterCommandSize = 2;
-  const uint8_t parameterCommand[parameterCommandSize] = {
-    TxSetParameters,
-    fAutomaticRATS | fAutomaticATR_RES,
-  };
-  if (sendCommand(parameterCommand, parameterCommandSize, responseBuffer, responseBufferSize, 100) < 0) {
+  static constexpr auto parameterFrame = pn532CommandFrame<TxSetParameters>({ fAutomaticRATS | fAutomaticATR_RES });
+  PN532Frame response;
+  if (sendEncodedCommand(parameterFrame.bytes, parameterFrame.size(), response, 100) < 0) {
     printf("Could not set paramters");
     return -1;
   }
+  return 0;
+}
+
+int PN532::configureMode(SetupMode mode) {
+  PN532Frame response;
 
   switch (mode) {
   case InitiatorMode: {
-    writeRegister(RegisterCIU_TxMode,
-                  1 << 7 // Enable CRC
-                  );
-    writeRegister(RegisterCIU_RxMode,
-                  1 << 7 // Enable CRC
-                  );
-
-    const int rfConfigFieldCommandSize = 3;
-    const uint8_t rfConfigFieldCommand[rfConfigFieldCommandSize] = {
-      TxRFConfiguration,
-      0x01, // RF Field
-      0 << 1 // Turn off Auto RFCA
-      | 1 << 0 // Turn on RF Field
-      ,
+    const RegisterValue modeRegisters[] = {
+      { RegisterCIU_TxMode, 1 << 7 }, // Enable CRC
+      { RegisterCIU_RxMode, 1 << 7 }, // Enable CRC
     };
 
-    if (sendCommand(rfConfigFieldCommand, rfConfigFieldCommandSize, responseBuffer, responseBufferSize, 100) < 0) {
-      printf("Could not configure RF field\n");
+    if (writeRegisters(modeRegisters, sizeof(modeRegisters) / sizeof(modeRegisters[0])) < 0) {
+      printf("Could not enable CRC\n");
       return -1;
     }
 
-    const int rfConfigMaxRetriesCommandSize = 5;
-    const uint8_t rfConfigMaxRetriesCommand[rfConfigMaxRetriesCommandSize] = {
-      TxRFConfiguration,
-      0x05, // Max Retries
-      0xFF, // MxRtyATR max retries for ATR_REQ
-      0xFF, // MxRtyPSL max retries for PSL_REQ
-      0xFF, // MxRtyPassiveActivation max retries in InListPassivetarget
-    };
+    if (setRFField(true) < 0) {
+      printf("Could not configure RF field\n");
+      return -1;
+    }
 
-    if (sendCommand(rfConfigMaxRetriesCommand, rfConfigMaxRetriesCommandSize, responseBuffer, responseBufferSize, 100) < 0) {
+    if (sendEncodedCommand(maxRetriesFrame.bytes, maxRetriesFrame.size(), response, 100) < 0) {
       printf("Could not configure RF field\n");
       return -1;
     }
@@ -383,43 +450,210 @@ int PN532::setUp(SetupMode mode) {
   }
 
   case TargetMode:
-    printf("*****TODO****");
-    exit(1);
+    // A target answers in the initiator's field and must not drive its own.
+    // ntag2xxEmulate sets up the CIU itself when it starts
+    if (setRFField(false) < 0) {
+      printf("Could not turn off RF field\n");
+      return -1;
+    }
+    break;
+  }
+  return 0;
+}
+
+int PN532::setRFField(bool on) {
+  static constexpr auto fieldOffFrame = pn532CommandFrame<TxRFConfiguration>({
+    0x01, // RF Field
+    0 << 1 // Turn off Auto RFCA
+    | 0 << 0, // RF Field off
+  });
+  static constexpr auto fieldOnFrame = pn532CommandFrame<TxRFConfiguration>({ 0x01, 0 << 1 | 1 << 0 });
+  const auto &frame = on ? fieldOnFrame : fieldOffFrame;
+
+  PN532Frame response;
+  return sendEncodedCommand(frame.bytes, frame.size(), response, 100) < 0 ? -1 : 0;
+}
+
+int PN532::probeAwake() {
+  // One attempt with the ACK timeout, rather than sendCommand's retries: a
+  // sleeping chip would cost several response timeouts
+  commandsSent++;
+  if (sendFrame(getFirmwareVersionFrame.bytes, getFirmwareVersionFrame.size()) < 0) return -1;
+  if (awaitAck() <= 0) return 0;
+
+  PN532Frame response;
+  return getResponse(response, MAX_RESPONSE_TIME) > 0 && response.command() == RxGetFirmwareVersion;
+}
+
+int PN532::isConfiguredFor(SetupMode mode) {
+  RegisterValue registers[] = { { RegisterCIU_TxMode }, { RegisterCIU_RxMode }, { RegisterCIU_TxControl } };
+  if (readRegisters(registers, sizeof(registers) / sizeof(registers[0])) < 0) return -1;
+
+  bool rfFieldOn = (registers[2].value & 0x03) == 0x03; // Tx1RFEn, Tx2RFEn
+
+  switch (mode) {
+  case InitiatorMode:
+    return registers[0].value == 1 << 7 && registers[1].value == 1 << 7 && rfFieldOn;
+
+  case TargetMode:
+    return !rfFieldOn;
+  }
+  return 0;
+}
+
+int PN532::fastStart(SetupMode mode, StartupReport *report) {
+  uint64_t startedAt = monotonicNanoseconds();
+  int commandsBefore = commandsSent;
+
+  StartupReport result = {};
+  invalidateRegisterCache(); // Whatever we knew belongs to another process
+
+  // The HSU rate survives until power off, so a previous process may have left it fast
+  int awake = probeAwake();
+  for (size_t i = 0; !awake && i < sizeof(serialBaudRates) / sizeof(serialBaudRates[0]); i++) {
+    if (serialBaudRates[i].baudRate == serialBaudRate || setHostBaudRate(serialBaudRates[i].baudRate) < 0) continue;
+    awake = probeAwake();
+  }
+  if (awake <= 0) setHostBaudRate(PN532_DEFAULT_BAUD_RATE);
+  if (awake < 0) {
+    printf("Could not write to the PN532\n");
+    return -1;
+  }
+  result.wasAwake = awake > 0;
+
+  if (!result.wasAwake) {
+    // No need for GetFirmwareVersion, SAMConfiguration right behind the preamble
+    // confirms the chip is up. Nothing to wait for in between
+    const uint8_t preamble[] = { 0x55, 0x55, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    if (sendFrame(preamble, sizeof(preamble)) < 0) return -1;
+  }
+
+  // SAMConfiguration, SetParameters and the retry counts cannot be read back,
+  // so they are always sent. SAMConfiguration may rewrite CIU registers, so
+  // they are only checked after it
+  if (configureFirmware() < 0) return -1;
+  if (result.wasAwake) result.wasConfigured = isConfiguredFor(mode) > 0;
+
+  if (!result.wasConfigured) {
+    if (configureMode(mode) < 0) return -1;
+  } else if (mode == InitiatorMode) {
+    PN532Frame response;
+    if (sendEncodedCommand(maxRetriesFrame.bytes, maxRetriesFrame.size(), response, 100) < 0) return -1;
   }
+
+  result.nanoseconds = monotonicNanoseconds() - startedAt;
+  result.commands = commandsSent - commandsBefore;
+  printf("Ready in %.1f ms, %d commands (%s, %s)\n", result.nanoseconds / 1000000.0, result.commands,
+    result.wasAwake ? "was awake" : "woken up", result.wasConfigured ? "registers kept" : "registers set");
+
+  if (report) *report = result;
   return 0;
 }
 
 int PN532::setParameters(uint8_t parameters) {
   printf("Setting parameters\n");
-  const int commandSize = 2;
-  uint8_t command[commandSize] = { TxSetParameters, parameters };
-
-  const int responseBufferSize = 10;
-  uint8_t responseBuffer[responseBufferSize];
+  static constexpr auto parameterFrame = pn532CommandFrame<TxSetParameters>({ 0x00 });
+  auto frame = parameterFrame;
+  frame.set(1, parameters);
 
-  if (sendCommand(command, commandSize, responseBuffer, responseBufferSize, MAX_RESPONSE_TIME) < 0) {
+  PN532Frame response;
+  if (sendEncodedCommand(frame.bytes, frame.size(), response, MAX_RESPONSE_TIME) < 0) {
     printf("Error setting parameters\n");
     return -1;
   }
 
-  return !(responseBuffer[RESPONSE_PREFIX_LENGTH] == 0x13);
+  return !(response.command() == RxSetParameters);
+}
+
+bool PN532::commandPreservesRegisters(uint8_t commandCode) {
+  // Everything else (target init, passive target listing, SAM config...) lets
+  // the firmware rewrite CIU registers behind our back
+  switch (commandCode) {
+  case TxGetFirmwareVersion:
+  case TxSetSerialBaudRate:
+  case TxReadRegister:
+  case TxWriteRegister:
+  case TxSetParameters:
+  case TxRFConfiguration:
+  case TxInCommunicateThrough:
+  case TxTgGetInitiatorCommand:
+  case TxTgResponseToInitiator:
+    return true;
+
+  default:
+    return false;
+  }
 }
 
 int PN532::sendCommand(const uint8_t *command, int commandSize, uint8_t *responseBuffer, const size_t responseBufferSize, int timeout) {
+  PN532Frame response;
+  int responseSize = sendCommand(command, commandSize, response, timeout);
+  return copyResponse(response, responseSize, responseBuffer, responseBufferSize);
+}
+
+int PN532::sendEncodedCommand(const uint8_t *frame, size_t frameSize, uint8_t *responseBuffer, const size_t responseBufferSize, int timeout) {
+  PN532Frame response;
+  int responseSize = sendEncodedCommand(frame, frameSize, response, timeout);
+  return copyResponse(response, responseSize, responseBuffer, responseBufferSize);
+}
+
+int PN532::copyResponse(const PN532Frame &response, int responseSize, uint8_t *responseBuffer, const size_t responseBufferSize) {
+  if (responseSize <= 0) return responseSize;
+
+  if ((size_t)responseSize > responseBufferSize) {
+    printf("Response too large for buffer: %d > %d\n", responseSize, (int)responseBufferSize);
+    responseSize = responseBufferSize;
+  }
+
+  memcpy(responseBuffer, response.raw(), responseSize);
+  return responseSize;
+}
+
+int PN532::sendCommand(const uint8_t *command, int commandSize, PN532Frame &response, int timeout) {
+  int frameSize = pn532FrameSize(commandSize);
+  uint8_t frame[frameSize];
+
+  if (pn532EncodeFrame(0xD4, command, commandSize, frame, frameSize) < 0) { // 0xD4 = controller to PN532
+    printf("Frame too large: %d\n", commandSize);
+    return -1;
+  }
+
+  return sendEncodedCommand(frame, frameSize, response, timeout);
+}
+
+int PN532::sendEncodedCommand(const uint8_t *frame, size_t frameSize, PN532Frame &response, int timeout, CommandTiming *timing) {
   //  0 = block indefinitely
   // >0 = timeout (ms)
+  PN532FrameHeader header;
+  if (pn532DecodeFrameHeader(frame, frameSize, &header) < PN532FrameNormal || header.length < 2) {
+    printf("Not a command frame\n");
+    return -1;
+  }
+
+  uint8_t commandCode = frame[header.tfiOffset + 1];
+  commandsSent++;
+  if (!commandPreservesRegisters(commandCode)) invalidateRegisterCache();
+
   int ackResponse = 0;
   int responseSize = 0;
+  int attempts = 0;
   do {
-    printf("Sending command\n");
-    if (sendFrame(command, commandSize) < 0) {
+    if (attempts++ == MAX_COMMAND_ATTEMPTS) {
+      printf("No answer to command %X after %d attempts\n", commandCode, MAX_COMMAND_ATTEMPTS);
+      return -1;
+    }
+
+    LOG_DEBUG(LogChannelCommand, "Sending command %X\n", commandCode);
+    if (sendFrame(frame, frameSize) < 0) {
       printf("Sending error\n");
       return -1;
     }
+    if (timing) timing->written = monotonicNanoseconds();
 
     ackResponse = awaitAck();
+    if (timing) timing->acked = monotonicNanoseconds();
 
-    responseSize = getResponse(responseBuffer, responseBufferSize, timeout * 10);
+    responseSize = getResponse(response, timeout * 10);
 
     if (responseSize < 0) {
       printf("Response error\n");
@@ -430,169 +664,260 @@ int PN532::sendCommand(const uint8_t *command, int commandSize, uint8_t *respons
   } while (!ackResponse && !responseSize);
 
   if (responseSize > 0) {
-    printf("Got response:\n");
-    printHex(responseBuffer, responseSize);
-    printFrame(responseBuffer, responseSize);
+    LOG_DEBUG(LogChannelCommand, "Got response %X\n", response.command());
+    if (LOG_ENABLED(LogSeverityTrace, LogChannelFrame)) {
+      printHex(response.raw(), responseSize, LogChannelFrame);
+      printFrame(response.raw(), responseSize);
+    }
   } else {
-    printf("No response: %d\n", responseSize);
+    LOG_DEBUG(LogChannelCommand, "No response: %d\n", responseSize);
   }
   return responseSize;
 }
 
-int PN532::sendFrame(const uint8_t *data, int size) {
-  int totalSize = size + 8;
-  uint8_t buffer[totalSize];
-
-  buffer[0] = 0x00; // Preamble
-  buffer[1] = 0x00; // Start code 0
-  buffer[2] = 0xFF; // Start code 1
-
-  if (size <= 255) {
-    buffer[3] = size + 1; // Size of data + size of TFI
-    buffer[4] = 0 - (size + 1); // Length checksum (LCS)
-    buffer[5] = 0xD4; // Frame indicator (TFI). 0xD4 = controller to PN532, 0xD5 = PN532 to controller
-    memcpy(buffer + 6, data, size); // Copy over data
-
-    uint8_t dcs = 0x00; // Equivalent to 256
-    dcs -= 0xD4;
-    for (int i = 0; i < size; i++) { dcs -= data[i]; }
-
-    buffer[size + 6] = dcs;
-    buffer[size + 7] = 0x00; // Postamble
-  } else {
-    // TODO:
-    printf("TODO: Extended frames\n");
+int PN532::sendFrame(const uint8_t *frame, size_t frameSize) {
+  if (LOG_ENABLED(LogSeverityTrace, LogChannelFrame)) {
+    log(LogChannelFrame, "Writing:\n");
+    printHex(frame, frameSize, LogChannelFrame);
+    printFrame(frame, frameSize);
   }
 
-  printf("Writing:\n");
-  printHex(buffer, totalSize);
-  printFrame(buffer, totalSize);
+  if (capture) capture->record(FrameCaptureHostToPN532, frame, frameSize);
 
-  return sp_blocking_write(port, buffer, totalSize, 10000) != totalSize;
+  return transport->write(frame, frameSize);
 }
 
 int PN532::awaitAck() {
-  const int bufferSize = 100;
-  uint8_t buffer[bufferSize];
-
-  const int bytesToRead = 6; // Full ACK/NACK and the useful part of error message
-
-  int responseSize = readSerialFrame(buffer, bufferSize, MAX_RESPONSE_TIME);
+  PN532Frame frame;
+  int responseSize = readSerialFrame(frame, MAX_RESPONSE_TIME);
 
   if (responseSize == 0) {
-    printf("Timed out waiting for ACK\n");
+    LOG_DEBUG(LogChannelCommand, "Timed out waiting for ACK\n");
     return responseSize;
   }
 
-  if (responseSize != bytesToRead) {
+  if (responseSize < 0) {
     printf("ACK read error: %d\n", responseSize);
-    printHex(buffer, responseSize);
     return -1;
   }
 
-  switch (buffer[3]) {
-  case 0:
-    if (buffer[4] == 0xFF) { // ACK
-      printf("ACK\n");
-      return 1;
-    }
-    break;
+  switch (frame.type()) {
+  case PN532FrameAck:
+    LOG_TRACE(LogChannelCommand, "ACK\n");
+    return 1;
 
-  case 0xFF:
-    if (buffer[4] == 0x00) { // NACK
-      printf("NACK\n");
-      return -1;
-    }
-    break;
+  case PN532FrameNack:
+    LOG_DEBUG(LogChannelCommand, "NACK\n");
+    return -1;
 
-  default: // Error
+  case PN532FrameError:
     printf("Error:\n");
-    printHex(buffer, responseSize);
+    printHex(frame.raw(), responseSize);
     return -4;
-  }
 
-  printf("Unknown response:\n");
-  printHex(buffer, responseSize);
-  return -3;
+  default:
+    printf("Unknown response:\n");
+    printHex(frame.raw(), responseSize);
+    return -3;
+  }
 }
 
-int PN532::getResponse(uint8_t *responseBuffer, int responseBufferSize, int timeout) {
-  size_t size = readSerialFrame(responseBuffer, responseBufferSize, timeout);
-  return size;
+int PN532::getResponse(PN532Frame &response, int timeout) {
+  return readSerialFrame(response, timeout);
 }
 
 int PN532::readTagId(uint8_t *idBuffer, uint8_t idBufferLength, uint8_t tagBaudRate) {
-  const int commandLength = 3;
-  uint8_t command[commandLength] = { TxInListPassiveTarget, 1, tagBaudRate };
-
-  const int responseBufferSize = 100;
-  uint8_t responseBuffer[responseBufferSize];
-
-  int responseSize = sendCommand(command, commandLength, responseBuffer, responseBufferSize, 100);
-  if (responseSize < 0) {
+  PassiveTarget target;
+  int found = listPassiveTarget(tagBaudRate, &target, 100);
+  if (found < 0) {
     printf("Error reading tag id\n");
     return -1;
   }
+  if (!found) return 0;
 
-  printFrame(responseBuffer, responseSize);
-
-  int idLength = responseBuffer[RESPONSE_PREFIX_LENGTH + 6];
-  int writeIdLength = idLength < idBufferLength ? idLength : idBufferLength;
-  memcpy(idBuffer, responseBuffer + RESPONSE_PREFIX_LENGTH + 7, writeIdLength);
+  int writeIdLength = target.idLength < idBufferLength ? target.idLength : idBufferLength;
+  memcpy(idBuffer, target.id, writeIdLength);
 
   return writeIdLength;
 }
 
+int PN532::listPassiveTarget(uint8_t tagBaudRate, PassiveTarget *target, int timeout) {
+  static constexpr auto listFrame = pn532CommandFrame<TxInListPassiveTarget>({
+    1, // MaxTg
+    TypeABaudRate, // BrTy
+  });
+  auto frame = listFrame;
+  frame.set(2, tagBaudRate);
+
+  PN532Frame response;
+  int responseSize = sendEncodedCommand(frame.bytes, frame.size(), response, timeout);
+  if (responseSize < 0) return -1;
+
+  if (LOG_ENABLED(LogSeverityTrace, LogChannelFrame)) printFrame(response.raw(), responseSize);
+
+  // NbTg, Tg, SENS_RES (2), SEL_RES, NFCIDLength, NFCID
+  const uint8_t *payload = response.payload();
+  if (responseSize == 0 || response.command() != RxInListPassiveTarget || response.payloadSize() < 6 || payload[0] == 0) return 0;
+
+  target->sensRes[0] = payload[2];
+  target->sensRes[1] = payload[3];
+  target->selRes = payload[4];
+
+  size_t idLength = payload[5];
+  if (idLength > response.payloadSize() - 6) idLength = response.payloadSize() - 6;
+  if (idLength > sizeof(target->id)) idLength = sizeof(target->id);
+  target->idLength = idLength;
+  memcpy(target->id, payload + 6, idLength);
+
+  return 1;
+}
+
+int PN532::setPassiveActivationRetries(uint8_t retries) {
+  static constexpr auto retriesFrame = pn532CommandFrame<TxRFConfiguration>({
+    0x05, // Max Retries
+    0xFF, // MxRtyATR max retries for ATR_REQ
+    0xFF, // MxRtyPSL max retries for PSL_REQ, as in setUp
+    0x00, // MxRtyPassiveActivation max retries in InListPassivetarget
+  });
+  auto frame = retriesFrame;
+  frame.set(4, retries);
+
+  PN532Frame response;
+  if (sendEncodedCommand(frame.bytes, frame.size(), response, MAX_RESPONSE_TIME) <= 0 || response.command() != RxRFConfiguration) {
+    printf("Could not set activation retries\n");
+    return -1;
+  }
+
+  return 0;
+}
+
 int PN532::samConfig(SamConfigurationMode mode, uint8_t timeout) {
   printf("Configuring SAM\n");
-  const int responseBufferSize = 50;
-  uint8_t responseBuffer[responseBufferSize];
-
-  const int commandSize = 3;
-  uint8_t command[commandSize] = { TxSAMConfiguration, mode, timeout };
+  static constexpr auto samFrame = pn532CommandFrame<TxSAMConfiguration>({ SamConfigurationModeNormal, 0 });
+  auto frame = samFrame;
+  frame.set(1, mode);
+  frame.set(2, timeout);
 
-  int responseSize = sendCommand(command, commandSize, responseBuffer, responseBufferSize, MAX_RESPONSE_TIME);
+  PN532Frame response;
+  int responseSize = sendEncodedCommand(frame.bytes, frame.size(), response, MAX_RESPONSE_TIME);
   if (responseSize <= 0) {
     printf("SAM config error: %d\n", responseSize);
     return -1;
   }
   printf("SAM configured\n");
 
-  return responseBuffer[RESPONSE_PREFIX_LENGTH + 0] == RxSAMConfiguration ? 0 : -2;
+  return response.command() == RxSAMConfiguration ? 0 : -2;
 }
 
 int PN532::ntag2xxReadPage(uint8_t page, uint8_t *buffer) {
   const int pageSize = 16;
 
-  const int commandSize = 4;
-  uint8_t command[commandSize] = {
-    TxInDataExchange,
+  static constexpr auto readFrame = pn532CommandFrame<TxInDataExchange>({
     1, // Selected tag
     NTAG21xReadPage,
-    page
-  };
+    0, // Page
+  });
+  auto frame = readFrame;
+  frame.set(3, page);
 
-  const int responseBufferSize = 100; // Max returned data is 262
-  uint8_t responseBuffer[responseBufferSize];
-  int responseSize = sendCommand(command, commandSize, responseBuffer, responseBufferSize, MAX_RESPONSE_TIME);
+  PN532Frame response;
+  int responseSize = sendEncodedCommand(frame.bytes, frame.size(), response, MAX_RESPONSE_TIME);
 
-  if (responseSize < 0) {
+  if (responseSize < 0 || response.payloadSize() < 1 + pageSize) {
     printf("Error reading page: %d\n", responseSize);
     return -1;
   }
 
-  printf("Read page:\n");
-  printFrame(responseBuffer, responseSize);
+  if (LOG_ENABLED(LogSeverityTrace, LogChannelFrame)) {
+    log(LogChannelFrame, "Read page:\n");
+    printFrame(response.raw(), responseSize);
+  }
 
-  memcpy(buffer, responseBuffer + RESPONSE_PREFIX_LENGTH + 2, pageSize);
+  memcpy(buffer, response.payload() + 1, pageSize); // Skip status
 
   return 0;
 }
 
+int PN532::ntag2xxPageCount() {
+  static constexpr auto versionFrame = pn532CommandFrame<TxInDataExchange>({
+    1, // Selected tag
+    NTAG21xGetVersion,
+  });
+
+  PN532Frame response;
+  int responseSize = sendEncodedCommand(versionFrame.bytes, versionFrame.size(), response, MAX_RESPONSE_TIME);
+
+  // Status, then 8 bytes of version info
+  if (responseSize <= 0 || response.payloadSize() < 9 || response.status() != 0x00) {
+    printf("Error getting version\n");
+    return -1;
+  }
+
+  const uint8_t *version = response.payload() + 1;
+  switch (version[6]) { // Storage size
+  case 0x0F: return 45; // NTAG213
+  case 0x11: return 135; // NTAG215
+  case 0x13: return 231; // NTAG216
+
+  default:
+    printf("Unknown storage size: %X\n", version[6]);
+    return -1;
+  }
+}
+
+int PN532::ntag2xxDumpTag(uint8_t *buffer, size_t bufferSize, NTAG2xxDumpStats *stats) {
+  uint64_t startTime = monotonicNanoseconds();
+  int exchanges = 0;
+
+  int pageCount = ntag2xxPageCount();
+  exchanges++;
+  if (pageCount < 0) return -1;
+
+  if ((size_t)pageCount * 4 > bufferSize) pageCount = bufferSize / 4;
+
+  // InDataExchange returns at most 262 bytes of tag data, so each FAST_READ covers that many pages
+  const int maxPagesPerRead = 262 / 4;
+
+  PN532Frame response;
+
+  for (int startPage = 0; startPage < pageCount; startPage += maxPagesPerRead) {
+    int endPage = startPage + maxPagesPerRead - 1;
+    if (endPage >= pageCount) endPage = pageCount - 1;
+
+    static constexpr auto fastReadFrame = pn532CommandFrame<TxInDataExchange>({
+      1, // Selected tag
+      NTAG21xFastRead,
+      0, // Start page
+      0, // End page
+    });
+    auto frame = fastReadFrame;
+    frame.set(3, startPage);
+    frame.set(4, endPage);
+
+    int responseSize = sendEncodedCommand(frame.bytes, frame.size(), response, MAX_RESPONSE_TIME);
+    exchanges++;
+
+    int readSize = (endPage - startPage + 1) * 4;
+    if (responseSize <= 0 || response.status() != 0x00 || response.payloadSize() < (size_t)readSize + 1) {
+      printf("Error reading pages %d-%d\n", startPage, endPage);
+      return -1;
+    }
+
+    memcpy(buffer + startPage * 4, response.payload() + 1, readSize); // Skip status
+  }
+
+  if (stats) {
+    stats->pageCount = pageCount;
+    stats->exchanges = exchanges;
+    stats->elapsedNanoseconds = monotonicNanoseconds() - startTime;
+  }
+
+  return pageCount * 4;
+}
+
 int PN532::initAsTarget(uint8_t mode, const uint8_t *mifareParams, uint8_t responseBuffer[], const size_t responseBufferSize) {
   printf("Initializing as target\n");
-  uint8_t command[] = {
-    TxTgInitAsTarget,
+  static constexpr auto initFrame = pn532CommandFrame<TxTgInitAsTarget>({
     TargetModePassiveOnly,
 
     // Mifare Params
@@ -613,86 +938,220 @@ int PN532::initAsTarget(uint8_t mode, const uint8_t *mifareParams, uint8_t respo
 
     0, // Length of historical bytes (max 48)
     // Historical bytes would go here
-  };
+  });
 
-  memcpy(command + 2, mifareParams, 6);
+  auto frame = initFrame;
+  frame.set(1, mode);
+  for (int i = 0; i < 6; i++) frame.set(2 + i, mifareParams[i]);
 
-  return sendCommand(command, sizeof(command), responseBuffer, responseBufferSize, 1000);
+  return sendEncodedCommand(frame.bytes, frame.size(), responseBuffer, responseBufferSize, 1000);
 }
 
 int PN532::getInitiatorCommand(uint8_t *responseBuffer, const size_t responseBufferSize) {
-  const uint8_t command[] = { 0x88 };
-  return sendCommand(command, 1, responseBuffer, responseBufferSize, 100);
+  return sendEncodedCommand(getInitiatorCommandFrame.bytes, getInitiatorCommandFrame.size(), responseBuffer, responseBufferSize, 100);
+}
+
+int PN532::getInitiatorCommand(PN532Frame &response) {
+  return sendEncodedCommand(getInitiatorCommandFrame.bytes, getInitiatorCommandFrame.size(), response, 100);
 }
 
 int PN532::writeRegister(uint16_t registerAddress, uint8_t registerValue) {
-  const int commandSize = 4;
-  const uint8_t command[commandSize] = {
-    TxWriteRegister,
-    registerAddress >> 8, // High bytes of address
-    registerAddress & 0xFF, // Low bytes of address
-    registerValue,
-  };
+  RegisterValue reg = { registerAddress, registerValue };
+  return writeRegisters(&reg, 1);
+}
 
-  const int responseBufferSize = 100;
-  uint8_t responseBuffer[responseBufferSize];
-  int responseSize = sendCommand(command, commandSize, responseBuffer, responseBufferSize, MAX_RESPONSE_TIME);
+uint8_t PN532::readRegister(uint16_t registerAddress) {
+  uint8_t value;
+  if (readRegister(registerAddress, &value) < 0) return -1;
 
-  if (responseBuffer[RESPONSE_PREFIX_LENGTH] != 0x09) {
-    printf("Error writing register\n");
-    printHex(responseBuffer, responseSize);
-    return -1;
+  return value;
+}
+
+int PN532::readRegister(uint16_t registerAddress, uint8_t *value) {
+  RegisterValue reg = { registerAddress, 0 };
+  if (readRegisters(&reg, 1) < 0) return -1;
+
+  *value = reg.value;
+  return 0;
+}
+
+bool PN532::isCachedRegister(uint16_t registerAddress) {
+  // Only configuration registers the chip does not change on its own
+  switch (registerAddress) {
+  case RegisterCIU_TxMode:
+  case RegisterCIU_RxMode:
+  case RegisterCIU_TxAuto:
+  case RegisterCIU_ManualRCV:
+  case RegisterCIU_BitFraming:
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+void PN532::invalidateRegisterCache() {
+  registerCacheValid = 0;
+}
+
+int PN532::writeRegisters(const RegisterValue *registers, size_t count) {
+  RegisterValue pending[count];
+  size_t pendingCount = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    const RegisterValue &reg = registers[i];
+    if (isCachedRegister(reg.address)) {
+      uint64_t bit = 1ull << (reg.address & 0x3F);
+      if ((registerCacheValid & bit) && registerCache[reg.address & 0x3F] == reg.value) continue; // Already set
+    }
+
+    pending[pendingCount++] = reg;
+  }
+
+  if (!pendingCount) return 0;
+
+  int responseSize = writeRegistersUncached(pending, pendingCount);
+  if (responseSize < 0) {
+    invalidateRegisterCache(); // Part of the batch may have been applied
+    return responseSize;
+  }
+
+  for (size_t i = 0; i < pendingCount; i++) {
+    if (isCachedRegister(pending[i].address)) {
+      registerCache[pending[i].address & 0x3F] = pending[i].value;
+      registerCacheValid |= 1ull << (pending[i].address & 0x3F);
+    }
   }
 
   return responseSize;
 }
 
-uint8_t PN532::readRegister(uint16_t registerAddress) {
-  const int commandSize = 3;
-  const uint8_t command[commandSize] = { TxReadRegister, registerAddress >> 8, registerAddress & 0xFF };
+int PN532::readRegisters(RegisterValue *registers, size_t count) {
+  RegisterValue misses[count];
+  size_t missIndices[count];
+  size_t missCount = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    RegisterValue &reg = registers[i];
+    if (isCachedRegister(reg.address) && (registerCacheValid & (1ull << (reg.address & 0x3F)))) {
+      reg.value = registerCache[reg.address & 0x3F];
+      continue;
+    }
 
-  const int responseBufferSize = 100;
-  uint8_t responseBuffer[responseBufferSize];
+    missIndices[missCount] = i;
+    misses[missCount++] = reg;
+  }
 
-  int responseSize = sendCommand(command, commandSize, responseBuffer, responseBufferSize, MAX_RESPONSE_TIME);
+  if (!missCount) return 0;
 
-  if (responseBuffer[RESPONSE_PREFIX_LENGTH] != RxReadRegister) {
-    printf("Error writing register\n");
-    printHex(responseBuffer, responseSize);
-    return -1;
+  int responseSize = readRegistersUncached(misses, missCount);
+  if (responseSize < 0) return responseSize;
+
+  for (size_t i = 0; i < missCount; i++) {
+    registers[missIndices[i]].value = misses[i].value;
+
+    if (isCachedRegister(misses[i].address)) {
+      registerCache[misses[i].address & 0x3F] = misses[i].value;
+      registerCacheValid |= 1ull << (misses[i].address & 0x3F);
+    }
   }
 
-  return responseBuffer[RESPONSE_PREFIX_LENGTH + 1];
+  return responseSize;
 }
 
-int PN532::escapeAutoEmulation(uint8_t *responseBuffer, const size_t responseBufferSize) {
-  printf("Attempting to escape auto-emulation\n");
+int PN532::writeRegistersUncached(const RegisterValue *registers, size_t count) {
+  const size_t registerSize = 3; // ADRH, ADRL, value
+  const size_t maxRegistersPerCommand = (PN532_NORMAL_FRAME_MAX_LENGTH - 2) / registerSize; // Fill one normal information frame (minus TFI and command code)
 
-  printf("- Setting registers\n");
-  int responseSize = writeRegister(RegisterCIU_TxMode,
-                                   1 << 7 // TxCRCEn automatically handle CRC
-                                   | 0 // TxSpeed 000 = 106 kbit/s
-                                   | 0 << 3 // InvMod don't invert modulation
-                                   | 0 << 2 // TxMix don't mix SIGIN with internal coder
-                                   | 0 // TxFraming 00 = ISO14443A
-                                   );
+  PN532Frame response;
+  int responseSize = 0;
 
-  if (responseSize < 0) {
-    printf("Error writing to tx register\n");
-    return -1;
+  // Every register in a chunk shares one ACK + response round trip
+  for (size_t first = 0; first < count; first += maxRegistersPerCommand) {
+    size_t chunkCount = count - first < maxRegistersPerCommand ? count - first : maxRegistersPerCommand;
+
+    const int commandSize = 1 + chunkCount * registerSize;
+    uint8_t command[commandSize];
+    command[0] = TxWriteRegister;
+    for (size_t i = 0; i < chunkCount; i++) {
+      const RegisterValue &reg = registers[first + i];
+      command[1 + i * registerSize] = reg.address >> 8; // High bytes of address
+      command[2 + i * registerSize] = reg.address & 0xFF; // Low bytes of address
+      command[3 + i * registerSize] = reg.value;
+    }
+
+    responseSize = sendCommand(command, commandSize, response, MAX_RESPONSE_TIME);
+
+    if (responseSize <= 0 || response.command() != RxWriteRegister) {
+      printf("Error writing register\n");
+      if (responseSize > 0) printHex(response.raw(), responseSize);
+      return -1;
+    }
   }
 
-  responseSize = writeRegister(RegisterCIU_RxMode,
-                               1 << 7 // TxCRCEn automatically handle CRC
-                               | 0 // TxSpeed 000 = 106 kbit/s
-                               | 1 << 3 // RxNoErr ignore invalid streams
-                               | 0 << 2 //  RxMultiple  receive multiple frames at once
-                               | 0 // RxFraming 00 = ISO14443A
-                               );
+  return responseSize;
+}
+
+int PN532::readRegistersUncached(RegisterValue *registers, size_t count) {
+  const size_t addressSize = 2; // ADRH, ADRL
+  const size_t maxRegistersPerCommand = (PN532_NORMAL_FRAME_MAX_LENGTH - 2) / addressSize; // Fill one normal information frame (minus TFI and command code)
+
+  PN532Frame response;
+  int responseSize = 0;
+
+  // Every register in a chunk shares one ACK + response round trip
+  for (size_t first = 0; first < count; first += maxRegistersPerCommand) {
+    size_t chunkCount = count - first < maxRegistersPerCommand ? count - first : maxRegistersPerCommand;
+
+    const int commandSize = 1 + chunkCount * addressSize;
+    uint8_t command[commandSize];
+    command[0] = TxReadRegister;
+    for (size_t i = 0; i < chunkCount; i++) {
+      command[1 + i * addressSize] = registers[first + i].address >> 8; // High bytes of address
+      command[2 + i * addressSize] = registers[first + i].address & 0xFF; // Low bytes of address
+    }
 
+    responseSize = sendCommand(command, commandSize, response, MAX_RESPONSE_TIME);
 
+    // Values come back in request order, one byte each
+    if (responseSize <= 0 || response.command() != RxReadRegister || response.payloadSize() < chunkCount) {
+      printf("Error reading register\n");
+      if (responseSize > 0) printHex(response.raw(), responseSize);
+      return -1;
+    }
+
+    for (size_t i = 0; i < chunkCount; i++) {
+      registers[first + i].value = response.payload()[i];
+    }
+  }
+
+  return responseSize;
+}
+
+int PN532::escapeAutoEmulation(uint8_t *responseBuffer, const size_t responseBufferSize) {
+  printf("Attempting to escape auto-emulation\n");
+
+  printf("- Setting registers\n");
+  const RegisterValue modeRegisters[] = {
+    { RegisterCIU_TxMode,
+      1 << 7 // TxCRCEn automatically handle CRC
+      | 0 // TxSpeed 000 = 106 kbit/s
+      | 0 << 3 // InvMod don't invert modulation
+      | 0 << 2 // TxMix don't mix SIGIN with internal coder
+      | 0 // TxFraming 00 = ISO14443A
+    },
+    { RegisterCIU_RxMode,
+      1 << 7 // TxCRCEn automatically handle CRC
+      | 0 // TxSpeed 000 = 106 kbit/s
+      | 1 << 3 // RxNoErr ignore invalid streams
+      | 0 << 2 //  RxMultiple  receive multiple frames at once
+      | 0 // RxFraming 00 = ISO14443A
+    },
+  };
+
+  int responseSize = writeRegisters(modeRegisters, sizeof(modeRegisters) / sizeof(modeRegisters[0]));
   if (responseSize < 0) {
-    printf("Error writing to tx register\n");
+    printf("Error writing to tx/rx registers\n");
     return -1;
   }
 
@@ -711,98 +1170,96 @@ int PN532::escapeAutoEmulation(uint8_t *responseBuffer, const size_t responseBuf
   printFrame(responseBuffer, responseSize);
 
   printf("Changing settings\n");
-  int registerResponseSize = writeRegister(RegisterCIU_RxMode, 0); // Disbable Rx CRC
-  if (responseSize < 0) {
-    printf("Error writing to rx register\n");
-    return -1;
-  }
+  const RegisterValue rawRegisters[] = {
+    { RegisterCIU_RxMode, 0 }, // Disable Rx CRC
+    { RegisterCIU_TxMode, 0 }, // Disable Tx CRC
+    { RegisterCIU_ManualRCV, 1 << 3 }, // Disable Parity
+  };
 
-  registerResponseSize = writeRegister(RegisterCIU_TxMode, 0); // Disable Tx CRC
-  if (responseSize < 0) {
-    printf("Error writing to rx register\n");
+  if (writeRegisters(rawRegisters, sizeof(rawRegisters) / sizeof(rawRegisters[0])) < 0) {
+    printf("Error writing to rx/tx registers\n");
     return -1;
   }
 
-  registerResponseSize = writeRegister(RegisterCIU_ManualRCV, 1 << 3); // Disable Parity
-
   printf("Successfully escaped\n");
 
   return responseSize;
 }
 
-int PN532::ntag2xxEmulate(const uint8_t *uid, const uint8_t *data) {
+int PN532::ntag2xxEmulate(const uint8_t *uid, const uint8_t *data, int pageCount) {
+  // Build every response frame up front, before the initiator is waiting on us
+  NTAG2xxEmulator emulator;
+  if (emulator.load(uid, data, pageCount) < 0) return -1;
+
+  return ntag2xxEmulate(emulator);
+}
+
+int PN532::ntag2xxEmulate(NTAG2xxEmulator &emulator) {
   // TODO: Investigate what happens with FeliCa emulation
 
-  const int responseBufferSize = 300; // Initiator command can be up to 262
-  uint8_t responseBuffer[responseBufferSize];
+  const int initBufferSize = 300; // Initiator command can be up to 262
+  uint8_t initBuffer[initBufferSize];
 
-  int responseSize = escapeAutoEmulation(responseBuffer, responseBufferSize);
+  int responseSize = escapeAutoEmulation(initBuffer, initBufferSize);
+
+  // TgInitAsTarget and TgGetInitiatorCommand both answer with a status/mode byte followed by the initiator's command
+  PN532Frame request;
+  if (responseSize > 0) {
+    PN532FrameHeader header;
+    pn532DecodeFrameHeader(initBuffer, responseSize, &header);
+    request = PN532Frame(initBuffer, header);
+  }
+
+  uint64_t received = 0; // When the current initiator command arrived
 
   while (responseSize > 0) {
     if (shouldQuit) return 0;
 
-    uint8_t status = responseBuffer[RESPONSE_PREFIX_LENGTH + 1];
+    if (request.payloadSize() < 2) {
+      printf("Received empty initiator command\n");
+      return -1;
+    }
+
+    uint8_t status = request.status();
 
     if (status == 0x02) {
-      printf("CRC Error\n");
+      LOG_DEBUG(LogChannelEmulation, "CRC Error\n");
       //writeRegister(uint16_t registerAddress, uint8_t registerValue)
 
     } else {
-      printf("Status OK\n");
+      LOG_TRACE(LogChannelEmulation, "Status OK\n");
     }
 
-    uint8_t responseCommand = responseBuffer[RESPONSE_PREFIX_LENGTH + 2];
+    const uint8_t *initiatorCommand = request.payload() + 1;
+    uint8_t opcode = initiatorCommand[0];
 
-    uint8_t *nextCommand;
-    int nextCommandSize;
+    NTAG2xxResponse response;
+    emulator.handleCommand(initiatorCommand, request.payloadSize() - 1, &response);
+    uint64_t dispatched = latencyStats ? monotonicNanoseconds() : 0;
 
-    switch (responseCommand) {
-    case NTAG21xReadPage: {
-      const int commandSize = 17;
-      uint8_t command[commandSize] = { TxTgResponseToInitiator, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-      uint8_t page = responseBuffer[RESPONSE_PREFIX_LENGTH + 3];
-      printf("Sending page: %X\n", page);
-      memcpy(command + 1, data + (page * 4), 16);
+    // Commands we stay silent on (HLTA, someone else's SELECT) go straight to the next one
+    if (response.frame) {
+      if (setTxLastBits(response.bitsInLastByte) < 0) return -2;
 
-      nextCommand = command;
-      nextCommandSize = commandSize;
-      break;
-    }
-
-    case NTAG21xRequest: {
-      printf("Got REQA\n");
-      printf("Replying with ATQA\n");
-      const int commandSize = 3;
-      uint8_t command[commandSize] = { TxTgResponseToInitiator, 0x44, 0x00 };
-      nextCommand = command;
-      nextCommandSize = commandSize;
-      break;
-    }
+      CommandTiming timing;
+      responseSize = sendEncodedCommand(response.frame, response.frameSize, request, 100, &timing);
 
-    case 0xA0:
-    case 0x79:
-    case NTAG21xHalt:
-      nextCommandSize = 0;
-      printf("Halting\n");
-      //sleep(3);
-      break;
-      // return 0;
-
-    default:
-      printf("Received unknown command: %X\n", responseCommand);
-      return -1;
+      // The first command arrives inside escapeAutoEmulation, so its arrival time is unknown
+      if (latencyStats && received && responseSize > 0) {
+        latencyStats->record(opcode, received, dispatched, timing.written, timing.acked);
+      }
     }
 
-    if (nextCommandSize)
-      responseSize = sendCommand(nextCommand, nextCommandSize, responseBuffer, responseBufferSize, 100);
-
     if (responseSize < 0) {
       printf("Error sending response\n");
       return -2;
     }
 
-    printf("Getting next command\n");
-    responseSize = getInitiatorCommand(responseBuffer, responseBufferSize);
+    if (latencyStats) latencyStats->printIfRequested();
+
+    LOG_TRACE(LogChannelEmulation, "Getting next command\n");
+    responseSize = getInitiatorCommand(request);
+    received = lastFrameNanoseconds;
   }
 
   return 0;
@@ -814,10 +1271,6 @@ int PN532::sendRawBitsInitiator(const uint8_t *bitData, const size_t bitCount, u
   const uint8_t bitsInLastFrame = bitCount % 8;
   size_t frameByteCount = (bitCount / 8) + (bitsInLastFrame ? 1 : 0); // szFrameBytes
 
-  uint8_t bitFraming = readRegister(RegisterCIU_BitFraming);
-  bitFraming |= bitsInLastFrame; // Send bitsInLastFrame bits from last byte
-  writeRegister(RegisterCIU_BitFraming, bitFraming);
-
   return sendRawBytesInitiator(bitData, frameByteCount, responseFrame, responseFrameSize, bitsInLastFrame);
 }
 
@@ -830,28 +1283,87 @@ int PN532::sendRawBytesInitiator(const uint8_t *byteData, const size_t byteCount
   command[0] = TxInCommunicateThrough;
   memcpy(command + 1, byteData, byteCount);
 
-  uint8_t bitFraming = readRegister(RegisterCIU_BitFraming);
-  if (bitsInLastFrame) {
-    bitFraming |= bitsInLastFrame; // Send bitsInLastFrame bits from last byte
-  } else {
-    bitFraming &= 0b11111000; // Other clear the previous value
-  }
-  writeRegister(RegisterCIU_BitFraming, bitFraming);
+  if (setTxLastBits(bitsInLastFrame) < 0) return -1;
 
   return sendCommand(command, commandSize, responseFrame, responseFrameSize, 100);
 }
 
+int PN532::transceiveBitsInitiator(const uint8_t *tx, size_t txBits, uint8_t rxAlign, uint8_t *rx, size_t rxSize, int *collisionBit) {
+  *collisionBit = -1;
+
+  size_t txBytes = (txBits + 7) / 8;
+  uint8_t command[1 + txBytes];
+  command[0] = TxInCommunicateThrough;
+  memcpy(command + 1, tx, txBytes);
+
+  uint8_t bitFraming;
+  if (readRegister(RegisterCIU_BitFraming, &bitFraming) < 0) return -1; // Never write StartSend back
+  bitFraming &= 0b10001000;
+  bitFraming |= (rxAlign & 0x07) << 4 | (txBits % 8); // RxAlign, TxLastBits
+  if (writeRegister(RegisterCIU_BitFraming, bitFraming) < 0) return -1;
+
+  PN532Frame response;
+  int responseSize = sendCommand(command, sizeof(command), response, 100);
+  if (responseSize < 0) return -1;
+  if (responseSize == 0 || response.payloadSize() < 1) return 0;
+
+  // Status, then whatever arrived before and after the collision
+  uint8_t status = response.payload()[0] & 0x3F;
+  if (status == 0x01) return 0; // Timeout, nobody answered
+
+  // Copied out now, response only lives until the register read below
+  size_t received = response.payloadSize() - 1;
+  if (received > rxSize) received = rxSize;
+  memcpy(rx, response.payload() + 1, received);
+
+  if (status != 0) {
+    // The CIU knows where the first collision was, the status byte does not
+    RegisterValue registers[] = { { RegisterCIU_Error }, { RegisterCIU_Coll } };
+    if (readRegisters(registers, 2) < 0) return -1;
+
+    bool collision = registers[0].value & 0x08; // CollErr
+    bool positionValid = !(registers[1].value & 0x20); // CollPosNotValid
+    if (!collision || !positionValid) {
+      LOG_DEBUG(LogChannelCommand, "Transceive failed, status %X\n", status);
+      return -1;
+    }
+
+    uint8_t position = registers[1].value & 0x1F; // 1-32, 0 = 32
+    *collisionBit = (position ? position : 32) - 1;
+  }
+
+  return received;
+}
+
+int PN532::setTxLastBits(uint8_t bitsInLastByte) {
+  // Both of these are answered from the register cache once it is warm,
+  // and the write is skipped when TxLastBits already matches. A failed read
+  // must not be written back: 0xFF has StartSend set
+  uint8_t bitFraming;
+  if (readRegister(RegisterCIU_BitFraming, &bitFraming) < 0) return -1;
+  bitFraming &= 0b10001000; // Clear the previous value, and RxAlign left over from anticollision
+  bitFraming |= bitsInLastByte; // Send bitsInLastByte bits from last byte (0 = all 8)
+  return writeRegister(RegisterCIU_BitFraming, bitFraming);
+}
+
+void PN532::setCapture(FrameCapture *capture) {
+  this->capture = capture;
+}
+
+void PN532::setLatencyStats(EmulationLatencyStats *latencyStats) {
+  this->latencyStats = latencyStats;
+}
+
 void PN532::close() {
   printf("Closing port\n");
-  shouldQuit = true;
-  if (port) {
-    sp_close(port);
-    port = NULL;
-    printf("Port closed\n");
-  }
+  if (shouldQuit.exchange(true)) return; // Already closed
+
+  transport->close();
+  printf("Port closed\n");
 }
 
 PN532::~PN532() {
   printf("Destructing\n");
   close();
+  delete transport;
 }
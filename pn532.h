@@ -1,4 +1,9 @@
+#ifndef PN532_H
+#define PN532_H
+
+#include "iso14443a-anticollision.h"
 #include "logger.h"
+#include "pn532-frame.h"
 
 #include <stdlib.h>
 
@@ -6,11 +11,22 @@
 #include <stdint.h>
 #endif
 
-struct sp_port;
+#include <atomic>
+
+class FrameCapture;
+class PN532Transport;
+class EmulationLatencyStats;
+class NTAG2xxEmulator;
+
+#define PN532_DEFAULT_BAUD_RATE 115200 // HSU rate after power on
+#define PN532_MAX_BAUD_RATE 1288000
 
 class PN532 {
 public:
+  // Opens the port with pn532OpenTransport, exits if that fails
   PN532(const char *portName);
+  // Takes ownership of transport
+  PN532(PN532Transport *transport);
   ~PN532();
   void close();
 
@@ -20,26 +36,115 @@ public:
   };
 
   int wakeUp();
+  // Moves the serial link to the fastest rate up to maxBaudRate that both the
+  // host adapter and the PN532 handle, checked with a GetFirmwareVersion round
+  // trip. Falls back to slower rates when one fails, and stays at the current
+  // rate if none work. Returns -1 only if the PN532 is no longer reachable
+  int negotiateBaudRate(int maxBaudRate = PN532_MAX_BAUD_RATE);
+  int baudRate() const { return serialBaudRate; }
   int setUp(SetupMode mode);
+
+  struct StartupReport {
+    uint64_t nanoseconds; // From the call until the chip is ready
+    int commands; // Commands sent, probes included
+    bool wasAwake; // Answered without the wake-up preamble
+    bool wasConfigured; // CIU registers and RF field already set up for mode, e.g. by a process that crashed
+  };
+
+  // wakeUp + setUp for restarts: probes the chip first and only sends what
+  // it is missing. Prints the time to ready and fills in report if given
+  int fastStart(SetupMode mode, StartupReport *report = NULL);
+
   int sendCommand(const uint8_t *command, int commandSize, uint8_t *responseBuffer, const size_t responseBufferSize, int timeout);
+  // Same as above, but response points straight into the receive buffer
+  // and is only valid until the next command
+  int sendCommand(const uint8_t *command, int commandSize, PN532Frame &response, int timeout);
+  // When each step of a command happened, in monotonic nanoseconds
+  struct CommandTiming {
+    uint64_t written;
+    uint64_t acked;
+  };
+
+  // Same again for a command that is already a complete wire frame (see pn532EncodeFrame)
+  int sendEncodedCommand(const uint8_t *frame, size_t frameSize, PN532Frame &response, int timeout, CommandTiming *timing = NULL);
+  int sendEncodedCommand(const uint8_t *frame, size_t frameSize, uint8_t *responseBuffer, const size_t responseBufferSize, int timeout);
+  // When the last frame from the PN532 finished arriving, in monotonic nanoseconds
+  uint64_t lastFrameReceivedAt() const { return lastFrameNanoseconds; }
   int readTagId(uint8_t *idBuffer, uint8_t idBufferLength, uint8_t tagBaudRate);
+
+  // One Type A target as reported by InListPassiveTarget
+  struct PassiveTarget {
+    uint8_t sensRes[2]; // ATQA
+    uint8_t selRes; // SAK
+    uint8_t idLength;
+    uint8_t id[10];
+  };
+
+  // Lists at most one target. Returns 1 and fills in target when a tag
+  // answered, 0 when the PN532 gave up (see setPassiveActivationRetries)
+  int listPassiveTarget(uint8_t tagBaudRate, PassiveTarget *target, int timeout);
+  // How often InListPassiveTarget retries activation before reporting no tag.
+  // 0xFF = forever, which blocks the PN532 until a tag arrives
+  int setPassiveActivationRetries(uint8_t retries);
+
   int setParameters(uint8_t parameters);
   int initAsTarget(uint8_t mode, const uint8_t *mifareParams, uint8_t responseBuffer[], const size_t responseBufferSize);
   int getInitiatorCommand(uint8_t responseBuffer[], const size_t responseBufferSize);
+  int getInitiatorCommand(PN532Frame &response);
+
+  struct RegisterValue {
+    uint16_t address;
+    uint8_t value;
+  };
 
+  // 0xFF if the read fails, which is a valid value. Use the overload below
+  // when the value is written back
   uint8_t readRegister(uint16_t registerAddress);
+  // 0 or -1, value is only set on success
+  int readRegister(uint16_t registerAddress, uint8_t *value);
   int writeRegister(uint16_t registerAddress, uint8_t registerValue);
 
+  // Read/write many registers with one command per information frame
+  // readRegisters fills in each value
+  // Configuration registers are shadowed on the host, so cached reads and
+  // writes of an unchanged value never reach the chip
+  int readRegisters(RegisterValue *registers, size_t count);
+  int writeRegisters(const RegisterValue *registers, size_t count);
+
+  // Call when the chip may have changed registers without going through us
+  void invalidateRegisterCache();
+
   int escapeAutoEmulation(uint8_t *responseBuffer, const size_t responseBufferSize);
 
+  struct NTAG2xxDumpStats {
+    int pageCount;
+    int exchanges; // Command round trips, including GET_VERSION
+    uint64_t elapsedNanoseconds;
+  };
+
   int ntag2xxReadPage(uint8_t page, uint8_t *buffer);
-  int ntag2xxEmulate(const uint8_t *uid, const uint8_t *data);
+  int ntag2xxPageCount();
+  // Reads the whole tag with FAST_READ, as many pages per exchange as the PN532 returns
+  // Returns the number of bytes written to buffer
+  int ntag2xxDumpTag(uint8_t *buffer, size_t bufferSize, NTAG2xxDumpStats *stats = NULL);
+  // data holds pageCount 4-byte pages
+  int ntag2xxEmulate(const uint8_t *uid, const uint8_t *data, int pageCount);
+  // Answers with an emulator that is already loaded (see NTAG2xxEmulator::load)
+  int ntag2xxEmulate(NTAG2xxEmulator &emulator);
 
-  void printHex(const uint8_t buffer[], int size, LogChannel logChannel = (LogChannel)0);
-  void printFrame(const uint8_t *frame, const size_t frameLength);
+  static void printHex(const uint8_t buffer[], int size, LogChannel logChannel = (LogChannel)0);
+  static void printFrame(const uint8_t *frame, const size_t frameLength);
+
+  // Record every frame in both directions to capture (NULL to stop). Not owned
+  void setCapture(FrameCapture *capture);
+  // Time every answered initiator command in ntag2xxEmulate (NULL to stop). Not owned
+  void setLatencyStats(EmulationLatencyStats *latencyStats);
 
   int sendRawBitsInitiator(const uint8_t *bitData, const size_t bitCount, uint8_t *responseFrame, const size_t responseFrameSize);
   int sendRawBytesInitiator(const uint8_t *byteData, const size_t byteCount, uint8_t *responseFrame, const size_t responseFrameSize, const uint8_t bitsInLastFrame = 0);
+  // Bit oriented exchange for anticollision, see Iso14443aTransceiver::transceive.
+  // Expects TxMode/RxMode CRC to be off, as in tagmanualread
+  int transceiveBitsInitiator(const uint8_t *tx, size_t txBits, uint8_t rxAlign, uint8_t *rx, size_t rxSize, int *collisionBit);
 
   enum NFCParameters {
     fNADUsed = 1 << 0, // Use Network ADdress for initiator
@@ -61,6 +166,8 @@ public:
     RxReadRegister = 0x07,
     TxWriteRegister = 0x08,
     RxWriteRegister = 0x09,
+    TxSetSerialBaudRate = 0x10,
+    RxSetSerialBaudRate = 0x11,
     TxSetParameters = 0x12,
     RxSetParameters = 0x13,
     TxSAMConfiguration = 0x14,
@@ -101,32 +208,86 @@ public:
   };
 
   enum NTAG21xCommands {
-    NTAG21xRequest = 0x26,
+    NTAG21xRequest = 0x26, // REQA (7 bits)
+    NTAG21xWakeUp = 0x52, // WUPA (7 bits)
+    NTAG21xPasswordAuth = 0x1B,
     NTAG21xReadPage = 0x30,
-    NTAG21xWritePage = 0xA0,
+    NTAG21xReadCounter = 0x39,
+    NTAG21xFastRead = 0x3A,
+    NTAG21xReadSignature = 0x3C,
     NTAG21xHalt = 0x50,
+    NTAG21xGetVersion = 0x60,
+    NTAG21xSelectCL1 = 0x93, // Anticollision / select, cascade level 1
+    NTAG21xSelectCL2 = 0x95,
+    NTAG21xCompatibilityWrite = 0xA0,
+    NTAG21xWritePage = 0xA2,
   };
 
   enum Registers {
     RegisterCIU_TxMode = 0x6302,
     RegisterCIU_RxMode = 0x6303,
+    RegisterCIU_TxControl = 0x6304,
+    RegisterCIU_TxAuto = 0x6305,
     RegisterCIU_ManualRCV = 0x630D,
     RegisterCIU_Error = 0x6336,
     RegisterCIU_Control = 0x633C,
     RegisterCIU_BitFraming = 0x633D,
+    RegisterCIU_Coll = 0x633E,
   };
 
 private:
-  struct sp_port *port;
-  bool shouldQuit;
+  PN532Transport *transport;
+  FrameCapture *capture;
+  EmulationLatencyStats *latencyStats;
+  int serialBaudRate;
+  std::atomic<bool> shouldQuit; // Set by close, read by whichever thread is mid-command
+
+  // Shadow of CIU registers 0x6300-0x633F, indexed by the low 6 bits of the address
+  uint8_t registerCache[64];
+  uint64_t registerCacheValid; // Bit n set = registerCache[n] matches the chip
 
-  static const size_t serialBufferSize = 500;
-  uint8_t serialBuffer[serialBufferSize];
-  size_t readSize;
+  PN532RingBuffer receiveBuffer;
+  size_t frameInUseSize; // Bytes of the last returned frame, released on the next read
+  uint64_t lastFrameNanoseconds;
+  int commandsSent;
 
-  int getResponse(uint8_t *responseBuffer, int responseBufferSize, int timeout);
+  int getResponse(PN532Frame &response, int timeout);
   int awaitAck();
-  int sendFrame(const uint8_t *data, int size);
+  int sendFrame(const uint8_t *frame, size_t frameSize);
+  static int copyResponse(const PN532Frame &response, int responseSize, uint8_t *responseBuffer, const size_t responseBufferSize);
   int samConfig(SamConfigurationMode mode, uint8_t timeout = 0);
-  int readSerialFrame(uint8_t *buffer, const size_t bufferSize, int timeout);
+  int getFirmwareVersion();
+  int probeAwake();
+  // CIU registers and RF field as configureMode leaves them. Says nothing
+  // about SAMConfiguration or SetParameters, which cannot be read back
+  int isConfiguredFor(SetupMode mode);
+  int configure(SetupMode mode);
+  int configureFirmware(); // SAMConfiguration and SetParameters
+  int configureMode(SetupMode mode); // CIU registers, RF field and retries
+  int setRFField(bool on);
+  int switchBaudRate(int baudRate, uint8_t baudRateCode);
+  int setHostBaudRate(int baudRate);
+  static bool isCachedRegister(uint16_t registerAddress);
+  static bool commandPreservesRegisters(uint8_t commandCode);
+  int setTxLastBits(uint8_t bitsInLastByte);
+  int readRegistersUncached(RegisterValue *registers, size_t count);
+  int writeRegistersUncached(const RegisterValue *registers, size_t count);
+
+  void init();
+  int readSerialFrame(PN532Frame &frame, int timeout);
 };
+
+// Drives Iso14443aAnticollision through a PN532 in initiator mode
+class PN532Iso14443aTransceiver : public Iso14443aTransceiver {
+public:
+  PN532Iso14443aTransceiver(PN532 *device) : device(device) {}
+
+  int transceive(const uint8_t *tx, size_t txBits, uint8_t rxAlign, uint8_t *rx, size_t rxSize, int *collisionBit) override {
+    return device->transceiveBitsInitiator(tx, txBits, rxAlign, rx, rxSize, collisionBit);
+  }
+
+private:
+  PN532 *device;
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include "tag-image.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(TagImageArchiveHeader) == 24, "Archive header layout changed");
+static_assert(sizeof(TagImageSlot) == 24, "Slot layout changed");
+static_assert(sizeof(TagImageHeader) == 64, "Image header layout changed");
+
+static size_t paddingFor(size_t length) {
+  return (8 - (length % 8)) % 8; // Keep every image header 8-byte aligned
+}
+
+uint32_t tagImageUidHash(const uint8_t *uid, size_t uidSize) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < uidSize; i++) {
+    hash ^= uid[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+int tagImageHeaderFromDump(const uint8_t *pages, int pageCount, TagImageHeader *header) {
+  if (pageCount < 4 || pageCount > 0xFFFF) {
+    printf("Not an NTAG21x dump: %d pages\n", pageCount);
+    return -1;
+  }
+
+  memset(header, 0, sizeof(*header));
+
+  // UID0-2 in page 0 (then BCC0), UID3-6 in page 1
+  memcpy(header->uid, pages, 3);
+  memcpy(header->uid + 3, pages + 4, 4);
+  header->uidSize = 7;
+
+  switch (pageCount) {
+  case 45: header->type = TagImageTypeNTAG213; break;
+  case 135: header->type = TagImageTypeNTAG215; break;
+  case 231: header->type = TagImageTypeNTAG216; break;
+  default: header->type = TagImageTypeUnknown; break;
+  }
+
+  header->atqa[0] = 0x44;
+  header->atqa[1] = 0x00;
+  header->sak = 0x00;
+  header->pageCount = pageCount;
+
+  return 0;
+}
+
+const uint8_t *TagImage::version() const {
+  for (size_t i = 0; i < sizeof(header->version); i++) {
+    if (header->version[i]) return header->version;
+  }
+  return NULL;
+}
+
+TagImageArchive::TagImageArchive() : data(NULL), size(0), header(NULL), imageOffsets(NULL), slots(NULL) {}
+
+TagImageArchive::~TagImageArchive() {
+  close();
+}
+
+int TagImageArchive::open(const char *path) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("Could not open tag image archive %s\n", path);
+    return -1;
+  }
+
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) < 0 || (size_t)fileStat.st_size < sizeof(TagImageArchiveHeader)) {
+    printf("Tag image archive too short\n");
+    ::close(fd);
+    return -1;
+  }
+
+  void *mapping = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    printf("Could not map tag image archive\n");
+    return -1;
+  }
+
+  data = (const uint8_t *)mapping;
+  size = fileStat.st_size;
+
+  const TagImageArchiveHeader *archiveHeader = (const TagImageArchiveHeader *)data;
+  if (memcmp(archiveHeader->magic, TAG_IMAGE_MAGIC, sizeof(archiveHeader->magic)) || archiveHeader->version != TAG_IMAGE_VERSION) {
+    printf("Not a version %d tag image archive\n", TAG_IMAGE_VERSION);
+    close();
+    return -1;
+  }
+
+  // Only the tables are checked here. Images are bounds checked when they are looked up
+  uint64_t tablesEnd = archiveHeader->headerSize
+    + (uint64_t)archiveHeader->imageCount * sizeof(uint64_t)
+    + (uint64_t)archiveHeader->slotCount * sizeof(TagImageSlot);
+  bool slotCountValid = archiveHeader->slotCount && !(archiveHeader->slotCount & (archiveHeader->slotCount - 1));
+  if (tablesEnd > size || !slotCountValid || archiveHeader->headerSize % 8) {
+    printf("Corrupt tag image archive\n");
+    close();
+    return -1;
+  }
+
+  header = archiveHeader;
+  imageOffsets = (const uint64_t *)(data + header->headerSize);
+  slots = (const TagImageSlot *)(imageOffsets + header->imageCount);
+  return 0;
+}
+
+void TagImageArchive::close() {
+  if (data) {
+    munmap((void *)data, size);
+    data = NULL;
+  }
+  size = 0;
+  header = NULL;
+  imageOffsets = NULL;
+  slots = NULL;
+}
+
+TagImage TagImageArchive::imageAtOffset(uint64_t offset) const {
+  if (offset % 8 || offset + sizeof(TagImageHeader) > size) return TagImage();
+
+  const TagImageHeader *imageHeader = (const TagImageHeader *)(data + offset);
+  if (offset + sizeof(TagImageHeader) + imageHeader->pageCount * 4u > size) return TagImage();
+
+  return TagImage(imageHeader);
+}
+
+TagImage TagImageArchive::imageAt(size_t index) const {
+  if (index >= imageCount()) return TagImage();
+
+  return imageAtOffset(imageOffsets[index]);
+}
+
+TagImage TagImageArchive::find(const uint8_t *uid, size_t uidSize) const {
+  if (!header || uidSize > TAG_IMAGE_MAX_UID_SIZE) return TagImage();
+
+  uint32_t mask = header->slotCount - 1;
+  uint32_t slot = tagImageUidHash(uid, uidSize) & mask;
+
+  // The table is never more than half full, so this stops at an empty slot quickly
+  for (uint32_t probe = 0; probe < header->slotCount; probe++, slot = (slot + 1) & mask) {
+    const TagImageSlot &candidate = slots[slot];
+    if (!candidate.imageOffset) break;
+
+    if (candidate.uidSize == uidSize && !memcmp(candidate.uid, uid, uidSize)) {
+      return imageAtOffset(candidate.imageOffset);
+    }
+  }
+
+  return TagImage();
+}
+
+int TagImageArchiveWriter::add(const TagImageHeader &header, const uint8_t *pages) {
+  if (header.uidSize > TAG_IMAGE_MAX_UID_SIZE) {
+    printf("UID too long: %d bytes\n", header.uidSize);
+    return -1;
+  }
+
+  if (!uids.insert(std::string((const char *)header.uid, header.uidSize)).second) {
+    printf("Duplicate UID in tag image archive\n");
+    return -1;
+  }
+
+  headers.push_back(header);
+  pageData.push_back(std::vector<uint8_t>(pages, pages + header.pageCount * 4));
+  return 0;
+}
+
+int TagImageArchiveWriter::write(const char *path) const {
+  uint32_t slotCount = 2;
+  while (slotCount < headers.size() * 2) slotCount *= 2; // At most half full
+
+  TagImageArchiveHeader archiveHeader;
+  memset(&archiveHeader, 0, sizeof(archiveHeader));
+  memcpy(archiveHeader.magic, TAG_IMAGE_MAGIC, sizeof(archiveHeader.magic));
+  archiveHeader.version = TAG_IMAGE_VERSION;
+  archiveHeader.headerSize = sizeof(archiveHeader);
+  archiveHeader.imageCount = headers.size();
+  archiveHeader.slotCount = slotCount;
+
+  std::vector<uint64_t> imageOffsets(headers.size());
+  std::vector<TagImageSlot> slots(slotCount);
+  memset(slots.data(), 0, slots.size() * sizeof(TagImageSlot));
+
+  uint64_t offset = sizeof(archiveHeader) + imageOffsets.size() * sizeof(uint64_t) + slots.size() * sizeof(TagImageSlot);
+  for (size_t i = 0; i < headers.size(); i++) {
+    imageOffsets[i] = offset;
+    size_t pageBytes = pageData[i].size();
+    offset += sizeof(TagImageHeader) + pageBytes + paddingFor(pageBytes);
+
+    uint32_t slot = tagImageUidHash(headers[i].uid, headers[i].uidSize) & (slotCount - 1);
+    while (slots[slot].imageOffset) slot = (slot + 1) & (slotCount - 1);
+
+    memcpy(slots[slot].uid, headers[i].uid, headers[i].uidSize);
+    slots[slot].uidSize = headers[i].uidSize;
+    slots[slot].imageOffset = imageOffsets[i];
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    printf("Could not create tag image archive %s\n", path);
+    return -1;
+  }
+
+  const uint8_t padding[8] = {};
+  bool written = fwrite(&archiveHeader, sizeof(archiveHeader), 1, file) == 1
+    && fwrite(imageOffsets.data(), sizeof(uint64_t), imageOffsets.size(), file) == imageOffsets.size()
+    && fwrite(slots.data(), sizeof(TagImageSlot), slots.size(), file) == slots.size();
+
+  for (size_t i = 0; i < headers.size() && written; i++) {
+    size_t pageBytes = pageData[i].size();
+    written = fwrite(&headers[i], sizeof(TagImageHeader), 1, file) == 1
+      && fwrite(pageData[i].data(), 1, pageBytes, file) == pageBytes
+      && fwrite(padding, 1, paddingFor(pageBytes), file) == paddingFor(pageBytes);
+  }
+
+  if (fclose(file) != 0 || !written) {
+    printf("Could not write tag image archive %s\n", path);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,132 @@
+#ifndef TAG_IMAGE_H
+#define TAG_IMAGE_H
+
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Archive of tag images for emulation, used straight from a read-only memory
+// mapping: nothing is parsed or copied when an image is looked up.
+//
+// File layout (host byte order, everything 8-byte aligned):
+//   TagImageArchiveHeader
+//   uint64_t imageOffsets[imageCount] // File offset of each image, in the order they were added
+//   TagImageSlot slots[slotCount] // Open addressing hash table on UID, slotCount a power of two
+//   TagImageHeader, page data, padding to 8 bytes
+//   TagImageHeader, page data, padding to 8 bytes
+//   ...
+// Finding an image by UID hashes once and probes a few neighbouring slots,
+// so it costs the same with one image or thousands
+
+#define TAG_IMAGE_MAGIC "TAGIMAGE"
+#define TAG_IMAGE_VERSION 1
+#define TAG_IMAGE_MAX_UID_SIZE 10
+#define TAG_IMAGE_SIGNATURE_SIZE 32
+
+enum TagImageType {
+  TagImageTypeUnknown = 0,
+  TagImageTypeNTAG213 = 1,
+  TagImageTypeNTAG215 = 2,
+  TagImageTypeNTAG216 = 3,
+};
+
+struct TagImageArchiveHeader {
+  char magic[8]; // TAG_IMAGE_MAGIC, not null terminated
+  uint16_t version;
+  uint16_t headerSize; // sizeof(TagImageArchiveHeader)
+  uint32_t imageCount;
+  uint32_t slotCount;
+  uint32_t reserved;
+};
+
+struct TagImageSlot {
+  uint8_t uid[TAG_IMAGE_MAX_UID_SIZE];
+  uint8_t uidSize;
+  uint8_t reserved[5];
+  uint64_t imageOffset; // 0 = empty slot
+};
+
+struct TagImageHeader {
+  uint8_t uid[TAG_IMAGE_MAX_UID_SIZE];
+  uint8_t uidSize;
+  uint8_t type; // TagImageType
+  uint8_t atqa[2]; // As sent, LSB first
+  uint8_t sak;
+  uint8_t reserved;
+  uint16_t pageCount; // 4-byte pages following this header
+  uint8_t version[8]; // GET_VERSION response, all zero = derive from the page count
+  uint8_t signature[TAG_IMAGE_SIGNATURE_SIZE]; // READ_SIG response
+  uint8_t reserved2[6];
+};
+
+// One image inside a mapped archive. Only valid while the archive stays open
+class TagImage {
+public:
+  TagImage() : header(NULL) {}
+  TagImage(const TagImageHeader *header) : header(header) {}
+
+  bool isValid() const { return header != NULL; }
+
+  const uint8_t *uid() const { return header->uid; }
+  size_t uidSize() const { return header->uidSize; }
+  TagImageType type() const { return (TagImageType)header->type; }
+  const uint8_t *atqa() const { return header->atqa; }
+  uint8_t sak() const { return header->sak; }
+  int pageCount() const { return header->pageCount; }
+  const uint8_t *pages() const { return (const uint8_t *)(header + 1); }
+  // NULL when the image has no version bytes of its own
+  const uint8_t *version() const;
+  const uint8_t *signature() const { return header->signature; }
+
+private:
+  const TagImageHeader *header;
+};
+
+class TagImageArchive {
+public:
+  TagImageArchive();
+  ~TagImageArchive();
+
+  int open(const char *path);
+  void close();
+
+  size_t imageCount() const { return header ? header->imageCount : 0; }
+  TagImage imageAt(size_t index) const;
+  // Invalid TagImage if no image has this UID
+  TagImage find(const uint8_t *uid, size_t uidSize) const;
+
+private:
+  TagImage imageAtOffset(uint64_t offset) const;
+
+  const uint8_t *data;
+  size_t size;
+  const TagImageArchiveHeader *header;
+  const uint64_t *imageOffsets;
+  const TagImageSlot *slots;
+};
+
+// Builds an archive in memory, then writes it out in one go
+class TagImageArchiveWriter {
+public:
+  // header->pageCount pages are copied from pages. Returns -1 for a duplicate or oversized UID
+  int add(const TagImageHeader &header, const uint8_t *pages);
+  int write(const char *path) const;
+
+private:
+  std::vector<TagImageHeader> headers;
+  std::vector<std::vector<uint8_t>> pageData;
+  std::unordered_set<std::string> uids; // Raw UID bytes, for the duplicate check
+};
+
+uint32_t tagImageUidHash(const uint8_t *uid, size_t uidSize);
+
+// Fills in a header for a raw NTAG21x dump: UID from pages 0-1, type from the page count
+int tagImageHeaderFromDump(const uint8_t *pages, int pageCount, TagImageHeader *header);
+
+#endif
@@ -0,0 +1,110 @@
+#include "tag-library.h"
+
+#include <stdio.h>
+#include <string.h>
+
+TagLibrary::TagLibrary() {
+  archive = NULL;
+  frameReferences = 0;
+}
+
+int TagLibrary::add(const TagImage &image) {
+  if (!image.isValid() || image.uidSize() != NTAG2XX_UID_SIZE) {
+    printf("Not an NTAG21x image\n");
+    return -1;
+  }
+
+  NTAG2xxImage prepared;
+  memcpy(prepared.uid, image.uid(), NTAG2XX_UID_SIZE);
+  memcpy(prepared.atqa, image.atqa(), 2);
+  prepared.sak = image.sak();
+  if (image.version()) memcpy(prepared.version, image.version(), NTAG2XX_VERSION_SIZE);
+  else ntag2xxDefaultVersion(image.pageCount(), prepared.version);
+  memcpy(prepared.signature, image.signature(), NTAG2XX_SIGNATURE_SIZE);
+  prepared.pageCount = image.pageCount();
+  prepared.pages = image.pages();
+
+  return add(prepared);
+}
+
+int TagLibrary::add(const uint8_t *uid, const uint8_t *data, int pageCount) {
+  if (pageCount < 1 || pageCount > NTAG2XX_MAX_PAGES) {
+    printf("Invalid page count for emulation: %d\n", pageCount);
+    return -1;
+  }
+
+  pageCopies.push_back(std::vector<uint8_t>(data, data + pageCount * 4));
+
+  NTAG2xxImage prepared;
+  memcpy(prepared.uid, uid, NTAG2XX_UID_SIZE);
+  prepared.atqa[0] = 0x44;
+  prepared.atqa[1] = 0x00;
+  prepared.sak = 0x00;
+  ntag2xxDefaultVersion(pageCount, prepared.version);
+  memset(prepared.signature, 0, sizeof(prepared.signature));
+  prepared.pageCount = pageCount;
+  prepared.pages = pageCopies.back().data();
+
+  if (add(prepared) < 0) {
+    pageCopies.pop_back();
+    return -1;
+  }
+  return 0;
+}
+
+int TagLibrary::add(NTAG2xxImage image) {
+  if (image.pageCount < 1 || image.pageCount > NTAG2XX_MAX_PAGES) {
+    printf("Invalid page count for emulation: %d\n", image.pageCount);
+    return -1;
+  }
+
+  std::string uid((const char *)image.uid, NTAG2XX_UID_SIZE);
+  if (imagesByUid.count(uid)) {
+    printf("Duplicate UID in tag library\n");
+    return -1;
+  }
+
+  frameTables.push_back(std::vector<const uint8_t *>(image.pageCount));
+  std::vector<const uint8_t *> &frameTable = frameTables.back();
+
+  uint8_t frame[NTAG2XX_READ_FRAME_SIZE];
+  for (int page = 0; page < image.pageCount; page++) {
+    ntag2xxBuildReadFrame(image.pages, image.pageCount, page, frame);
+    frameTable[page] = internFrame(frame);
+  }
+  frameReferences += image.pageCount;
+
+  image.readFrames = frameTable.data();
+  images.push_back(image);
+  imagesByUid[uid] = &images.back();
+  return 0;
+}
+
+const uint8_t *TagLibrary::internFrame(const uint8_t *frame) {
+  // 00 00 FF LEN LCS D4 TgResponseToInitiator, then the page data
+  const size_t pageDataOffset = 7;
+  std::string key((const char *)frame + pageDataOffset, 16);
+
+  std::unordered_map<std::string, const uint8_t *>::iterator existing = framesByPages.find(key);
+  if (existing != framesByPages.end()) return existing->second;
+
+  frames.push_back(ReadFrame());
+  memcpy(frames.back().data(), frame, NTAG2XX_READ_FRAME_SIZE);
+  framesByPages[key] = frames.back().data();
+  return frames.back().data();
+}
+
+const NTAG2xxImage *TagLibrary::find(const uint8_t *uid, size_t uidSize) {
+  if (uidSize != NTAG2XX_UID_SIZE) return NULL;
+
+  std::unordered_map<std::string, const NTAG2xxImage *>::const_iterator found = imagesByUid.find(std::string((const char *)uid, uidSize));
+  if (found != imagesByUid.end()) return found->second;
+
+  // First use of an archive image: one probe of the archive's UID table, then build its frames
+  if (!archive) return NULL;
+
+  TagImage image = archive->find(uid, uidSize);
+  if (!image.isValid() || add(image) < 0) return NULL;
+
+  return &images.back();
+}
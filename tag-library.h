@@ -0,0 +1,72 @@
+#ifndef TAG_LIBRARY_H
+#define TAG_LIBRARY_H
+
+#include "ntag2xx-emulation.h"
+#include "tag-image.h"
+
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+#include <array>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Emulation-ready images for many tags, looked up by UID. An image's READ
+// frames are built once, when it is added or first found in the archive, and
+// a frame is stored only once however many images contain the same four
+// pages (blank user memory, shared NDEF records, identical config pages), so
+// thousands of dumps of the same kind of tag cost little more than one.
+// Images never change once added: hand them to NTAG2xxEmulator::switchImage
+// to change tags between field sessions.
+//
+// Not thread safe. find() adds the images it prepares, so find, add and
+// imageAt must all be called from one thread at a time. The images they
+// return stay valid and can be read from any thread
+class TagLibrary {
+public:
+  TagLibrary();
+
+  // Pages are used in place, so the archive must stay open as long as the library is used
+  int add(const TagImage &image);
+  // uid is NTAG2XX_UID_SIZE bytes, data holds pageCount 4-byte pages (copied)
+  int add(const uint8_t *uid, const uint8_t *data, int pageCount);
+  // Images in the archive are prepared the first time find() asks for their
+  // UID, so attaching one costs the same however many images it holds. The
+  // archive must stay open as long as the library is used
+  void setArchive(const TagImageArchive *archive) { this->archive = archive; }
+
+  // Prepares and adds the image from the archive on first use, so this is
+  // not a pure lookup. NULL if no image has this UID
+  const NTAG2xxImage *find(const uint8_t *uid, size_t uidSize);
+  const NTAG2xxImage *imageAt(size_t index) const { return index < images.size() ? &images[index] : NULL; }
+
+  size_t imageCount() const { return images.size(); }
+  // Distinct READ frames actually stored, against the total every image refers to
+  size_t uniqueFrameCount() const { return frames.size(); }
+  size_t frameReferenceCount() const { return frameReferences; }
+
+private:
+  typedef std::array<uint8_t, NTAG2XX_READ_FRAME_SIZE> ReadFrame;
+
+  int add(NTAG2xxImage image);
+  const uint8_t *internFrame(const uint8_t *frame);
+
+  // deques so pointers handed out stay put as the library grows
+  std::deque<NTAG2xxImage> images;
+  std::deque<std::vector<const uint8_t *>> frameTables;
+  std::deque<std::vector<uint8_t>> pageCopies;
+  std::deque<ReadFrame> frames;
+
+  const TagImageArchive *archive;
+  std::unordered_map<std::string, const NTAG2xxImage *> imagesByUid;
+  // Keyed by the 16 page bytes, which decide the rest of the frame
+  std::unordered_map<std::string, const uint8_t *> framesByPages;
+  size_t frameReferences;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#include "tag-poller.h"
+#include "time-utils.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define POLL_TIMEOUT 10 // Way longer than a bounded InListPassiveTarget takes
+
+TagPoller::TagPoller(PN532 *device) : device(device) {
+  departureMisses = 3;
+  present = false;
+  arrivedAt = 0;
+  lastSeenAt = 0;
+  misses = 0;
+  polls = 0;
+}
+
+int TagPoller::start(uint8_t activationRetries, int departureMisses) {
+  this->departureMisses = departureMisses > 0 ? departureMisses : 1;
+  present = false;
+  misses = 0;
+
+  return device->setPassiveActivationRetries(activationRetries);
+}
+
+static bool sameTarget(const PN532::PassiveTarget &a, const PN532::PassiveTarget &b) {
+  return a.idLength == b.idLength && !memcmp(a.id, b.id, a.idLength);
+}
+
+int TagPoller::poll(TagPresenceEvent *events) {
+  PN532::PassiveTarget target;
+  int found = device->listPassiveTarget(PN532::TypeABaudRate, &target, POLL_TIMEOUT);
+  uint64_t now = monotonicNanoseconds();
+  polls++;
+
+  if (found < 0) return -1;
+
+  int eventCount = 0;
+
+  if (present && (found ? !sameTarget(target, current) : ++misses >= departureMisses)) {
+    TagPresenceEvent &departed = events[eventCount++];
+    departed.type = TagPresenceEvent::Departed;
+    departed.target = current;
+    departed.nanoseconds = lastSeenAt;
+    departed.presentNanoseconds = lastSeenAt - arrivedAt;
+    present = false;
+  }
+
+  if (!found) return eventCount;
+
+  misses = 0;
+  lastSeenAt = now;
+  if (present) return eventCount;
+
+  present = true;
+  current = target;
+  arrivedAt = now;
+
+  TagPresenceEvent &arrived = events[eventCount++];
+  arrived.type = TagPresenceEvent::Arrived;
+  arrived.target = target;
+  arrived.nanoseconds = now;
+  arrived.presentNanoseconds = 0;
+  return eventCount;
+}
@@ -0,0 +1,57 @@
+#ifndef TAG_POLLER_H
+#define TAG_POLLER_H
+
+#include "pn532.h"
+
+#include <stdlib.h>
+
+#ifdef linux
+#include <stdint.h>
+#endif
+
+// A tag entering or leaving the field
+struct TagPresenceEvent {
+  enum Type {
+    Arrived,
+    Departed,
+  };
+
+  Type type;
+  PN532::PassiveTarget target;
+  uint64_t nanoseconds; // Monotonic. First poll that saw the tag, or last one that did for Departed
+  uint64_t presentNanoseconds; // Departed only: how long the tag was in the field
+};
+
+// Watches the field with back to back InListPassiveTarget commands. With
+// activation retries bounded, an empty field answers within a few
+// milliseconds instead of blocking the PN532 until a tag shows up, so each
+// poll is short and a tag is seen within one poll of arriving. A tag that
+// stays in the field is listed again every poll and only reported once;
+// it departs after departureMisses polls in a row without it
+class TagPoller {
+public:
+  TagPoller(PN532 *device);
+
+  // activationRetries is MxRtyPassiveActivation for every poll
+  int start(uint8_t activationRetries = 2, int departureMisses = 3);
+
+  // Polls once. Fills in up to 2 events (a departure, then an arrival when one
+  // tag replaces another) and returns how many, or -1 on a PN532 error
+  int poll(TagPresenceEvent *events);
+
+  bool tagPresent() const { return present; }
+  uint64_t pollCount() const { return polls; }
+
+private:
+  PN532 *device;
+  int departureMisses;
+
+  bool present;
+  PN532::PassiveTarget current;
+  uint64_t arrivedAt;
+  uint64_t lastSeenAt;
+  int misses;
+  uint64_t polls;
+};
+
+#endif
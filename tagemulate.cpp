@@ -1,27 +1,147 @@
+#include "frame-capture.h"
+#include "latency-histogram.h"
+#include "ntag2xx-emulation.h"
 #include "pn532.h"
+#include "tag-image.h"
+#include "tag-library.h"
 
+#include <ctype.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <libserialport.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
 
 PN532 *device;
+EmulationLatencyStats *latencyStats;
 
-bool shouldQuit = false;
+std::atomic<bool> shouldQuit(false);
 void signalHandler(int signal) {
   printf("Signal: %d\n", signal);
   shouldQuit = true;
   device->close();
 }
 
+void printStatsHandler(int signal) {
+  if (latencyStats) latencyStats->requestPrint();
+}
+
+// Hex UID, as printed by tagread and tagimage list. Spaces are ignored
+size_t parseUid(const char *text, uint8_t *uid, size_t uidBufferSize) {
+  size_t uidSize = 0;
+  int nibbles = 0;
+  for (; *text && uidSize < uidBufferSize; text++) {
+    if (!isxdigit(*text)) continue;
+
+    char digit[2] = { *text, 0 };
+    uid[uidSize] = (uid[uidSize] << 4) | strtol(digit, NULL, 16);
+    if (++nibbles % 2 == 0) uidSize++;
+  }
+  return uidSize;
+}
+
+// Reads UIDs from stdin, one per line, and switches the emulated tag to that
+// image. The switch happens at the next REQA/WUPA without touching the PN532.
+// Waits for input in short polls so it notices shouldQuit and can be joined
+void switchImages(NTAG2xxEmulator *emulator, TagLibrary *library) {
+  setvbuf(stdin, NULL, _IONBF, 0); // Nothing hidden in a stdio buffer where poll cannot see it
+
+  char line[128];
+  while (!shouldQuit) {
+    struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+    int ready = poll(&input, 1, 100);
+    if (ready == 0 || (ready < 0 && errno == EINTR)) continue;
+    if (ready < 0 || !fgets(line, sizeof(line), stdin)) break;
+
+    uint8_t uid[TAG_IMAGE_MAX_UID_SIZE] = {};
+    size_t uidSize = parseUid(line, uid, sizeof(uid));
+    if (!uidSize) continue;
+
+    const NTAG2xxImage *image = library->find(uid, uidSize);
+    if (!image) {
+      printf("No image for UID %s", line);
+      continue;
+    }
+
+    emulator->switchImage(image);
+    printf("Switching to UID %s", line);
+  }
+}
+
 int main(int argc, char **argv) {
   printf("Initializing NFC adapter\n");
 
-  if (argc != 2) {
+  const char *capturePath = NULL;
+  const char *archivePath = NULL;
+  const char *uidText = NULL;
+  bool printLatency = false;
+  int maxBaudRate = 0;
+  int option;
+  while ((option = getopt(argc, argv, "c:i:u:sb:")) != -1) {
+    switch (option) {
+    case 'i': // Tag image archive (build with tagimage)
+      archivePath = optarg;
+      break;
+
+    case 'u': // UID of the image to start with, in hex. Defaults to the first image
+      uidText = optarg;
+      break;
+
+    case 'c': // Record all PN532 traffic to a binary capture (decode with capturedump)
+      capturePath = optarg;
+      break;
+
+    case 's': // Per-command response latency, printed at exit or on SIGUSR1
+      printLatency = true;
+      break;
+
+    case 'b': // Fastest serial baud rate to try, e.g. 1288000
+      maxBaudRate = atoi(optarg);
+      break;
+
+    default:
+      printf("Usage: %s [-c capture file] [-i image archive [-u uid]] [-s] [-b max baud rate] <port>\n", argv[0]);
+      return -1;
+    }
+  }
+
+  if (optind != argc - 1) {
     printf("Please specify port name\n");
     return -1;
   }
 
+  // Images in the archive are prepared as they are first switched to, so
+  // startup costs the same with one image or thousands. Without an archive we
+  // fall back to the built-in image below
+  TagImageArchive archive;
+  TagLibrary library;
+  const NTAG2xxImage *image = NULL;
+  if (archivePath) {
+    if (archive.open(archivePath) < 0) return -1;
+    library.setArchive(&archive);
+
+    if (uidText) {
+      uint8_t uid[TAG_IMAGE_MAX_UID_SIZE] = {};
+      image = library.find(uid, parseUid(uidText, uid, sizeof(uid)));
+    } else if (archive.imageCount()) {
+      TagImage first = archive.imageAt(0);
+      image = library.find(first.uid(), first.uidSize());
+    }
+
+    if (!image) {
+      printf("Image not found in %s\n", archivePath);
+      return -1;
+    }
+
+    printf("Opened %d images\n", (int)archive.imageCount());
+  }
+
   signal(SIGABRT, signalHandler);
   signal(SIGINT, signalHandler);
   signal(SIGBUS, signalHandler);
@@ -29,14 +149,28 @@ int main(int argc, char **argv) {
   signal(SIGQUIT, signalHandler);
   signal(SIGTERM, signalHandler);
 
-  device = new PN532(argv[1]);
+  device = new PN532(argv[optind]);
 
-  if (device->wakeUp()) return -1;
-  if (device->setUp(PN532::TargetMode)) return -1;
+  FrameCapture capture;
+  if (capturePath) {
+    if (capture.open(capturePath) < 0) return -1;
+    device->setCapture(&capture);
+  }
+
+  EmulationLatencyStats stats;
+  if (printLatency) {
+    latencyStats = &stats;
+    device->setLatencyStats(&stats);
+    signal(SIGUSR1, printStatsHandler);
+  }
+
+  if (device->fastStart(PN532::TargetMode)) return -1;
+  if (maxBaudRate && device->negotiateBaudRate(maxBaudRate) < 0) return -1;
 
   const int responseBufferSize = 100;
   uint8_t responseBuffer[responseBufferSize];
 
+  // Built-in NTAG215 image, used when no archive is given
   const uint8_t uid[] = { 0x04, 0x17, 0xcd, 0x6a, 0xc5, 0x58, 0x81 };
   const uint8_t data[] = {
     0x04, 0x17, 0xcd, 0x56,
@@ -175,9 +309,26 @@ int main(int argc, char **argv) {
     0xd7, 0x5d, 0x98, 0x11,
     0x80, 0x80, 0x00, 0x00 };
 
-  device->ntag2xxEmulate(uid, data);
+  NTAG2xxEmulator emulator;
+  std::thread switcher;
+  if (image) {
+    if (emulator.load(image) < 0) return -1;
+
+    // The library is not thread safe: from here on only the switcher touches it
+    printf("Type a UID to switch tags\n");
+    switcher = std::thread(switchImages, &emulator, &library);
+  } else {
+    if (emulator.load(uid, data, sizeof(data) / 4) < 0) return -1;
+  }
+
+  device->ntag2xxEmulate(emulator);
+
+  // The switcher uses the library and emulator, so it has to stop before they go away
+  shouldQuit = true;
+  if (switcher.joinable()) switcher.join();
 
   printf("Finished emulating\n");
+  if (printLatency) stats.print();
 
   return 0;
 }
@@ -0,0 +1,99 @@
+#include "pn532.h"
+#include "tag-image.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+// Reads a tag dump: either raw page bytes, or hex text as printed by tagread
+static int readDump(const char *path, std::vector<uint8_t> &pages) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    printf("Could not open %s\n", path);
+    return -1;
+  }
+
+  std::vector<uint8_t> contents;
+  uint8_t buffer[4096];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) contents.insert(contents.end(), buffer, buffer + count);
+  fclose(file);
+
+  bool isHexText = !contents.empty();
+  for (size_t i = 0; i < contents.size() && isHexText; i++) {
+    isHexText = isxdigit(contents[i]) || isspace(contents[i]);
+  }
+
+  if (!isHexText) {
+    pages = contents;
+  } else {
+    pages.clear();
+    int nibbles = 0;
+    uint8_t value = 0;
+    for (size_t i = 0; i < contents.size(); i++) {
+      if (isspace(contents[i])) continue;
+
+      char digit[2] = { (char)contents[i], 0 };
+      value = (value << 4) | strtol(digit, NULL, 16);
+      if (++nibbles % 2 == 0) pages.push_back(value);
+    }
+  }
+
+  if (pages.size() % 4) {
+    printf("%s is not a whole number of pages (%d bytes)\n", path, (int)pages.size());
+    return -1;
+  }
+
+  return 0;
+}
+
+static int create(const char *archivePath, int dumpCount, char **dumpPaths) {
+  TagImageArchiveWriter writer;
+
+  for (int i = 0; i < dumpCount; i++) {
+    std::vector<uint8_t> pages;
+    if (readDump(dumpPaths[i], pages) < 0) return -1;
+
+    TagImageHeader header;
+    if (tagImageHeaderFromDump(pages.data(), pages.size() / 4, &header) < 0) return -1;
+    if (writer.add(header, pages.data()) < 0) return -1;
+  }
+
+  if (writer.write(archivePath) < 0) return -1;
+
+  printf("Wrote %d images to %s\n", dumpCount, archivePath);
+  return 0;
+}
+
+static int list(const char *archivePath) {
+  TagImageArchive archive;
+  if (archive.open(archivePath) < 0) return -1;
+
+  static const char *typeNames[] = { "unknown", "NTAG213", "NTAG215", "NTAG216" };
+
+  for (size_t i = 0; i < archive.imageCount(); i++) {
+    TagImage image = archive.imageAt(i);
+    if (!image.isValid()) {
+      printf("[%d] corrupt\n", (int)i);
+      continue;
+    }
+
+    printf("[%d] %-8s %3d pages UID ", (int)i, image.type() <= TagImageTypeNTAG216 ? typeNames[image.type()] : "unknown", image.pageCount());
+    PN532::printHex(image.uid(), image.uidSize());
+  }
+
+  printf("%d images\n", (int)archive.imageCount());
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 4 && !strcmp(argv[1], "create")) return create(argv[2], argc - 3, argv + 3);
+  if (argc == 3 && !strcmp(argv[1], "list")) return list(argv[2]);
+
+  printf("Usage: %s create <archive> <dump> [dump...]\n", argv[0]);
+  printf("       %s list <archive>\n", argv[0]);
+  printf("Dumps are raw page bytes or hex text as printed by tagread\n");
+  return -1;
+}
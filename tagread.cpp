@@ -1,61 +1,206 @@
 #include "logger.h"
+#include "frame-capture.h"
 #include "pn532.h"
+#include "pn532-async.h"
+#include "tag-poller.h"
+#include "time-utils.h"
 
 #include <libserialport.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
-PN532 *device;
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// One reader per port, each driven from its own I/O thread
+struct Reader {
+  const char *port;
+  PN532 *device;
+  PN532AsyncDevice *async;
+  FrameCapture capture;
+};
+
+// A tag arriving at or leaving one of the readers
+struct TagEvent {
+  const char *port;
+  TagPresenceEvent presence;
+  std::vector<uint8_t> dump; // Arrivals only. Empty if dumping failed
+  PN532::NTAG2xxDumpStats stats;
+};
+
+// Events from every reader, merged in arrival order for the main thread to print
+struct TagEventQueue {
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<TagEvent> events;
+
+  void push(TagEvent event) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      events.push_back(std::move(event));
+    }
+    wake.notify_one();
+  }
+};
+
+std::vector<Reader *> readers;
+TagEventQueue tagEvents;
+uint64_t startedAt;
 
-bool shouldQuit = false;
+// Only raised here. Each I/O thread notices within one poll and closes its own
+// device, so no port is closed under a thread that is still using it
+std::atomic<bool> shouldQuit(false);
 void signalHandler(int signal) {
   shouldQuit = true;
-  printf("Signal: %d\n", signal);
-  device->close();
+}
+
+// Runs on the reader's I/O thread until we are told to quit
+int readTags(PN532 &device, const char *port) {
+  TagPoller poller(&device);
+  if (poller.start() < 0) return -1;
+
+  while (!shouldQuit) {
+    TagPresenceEvent presence[2];
+    int eventCount = poller.poll(presence);
+    if (eventCount < 0) {
+      usleep(10000); // Don't spin on a reader that keeps failing
+      continue;
+    }
+
+    for (int i = 0; i < eventCount; i++) {
+      TagEvent event;
+      event.port = port;
+      event.presence = presence[i];
+
+      // The tag is still selected from the poll that found it
+      if (presence[i].type == TagPresenceEvent::Arrived) {
+        const int tagBufferSize = 231 * 4; // Largest NTAG21x (NTAG216)
+        uint8_t tagBuffer[tagBufferSize];
+        int dumpSize = device.ntag2xxDumpTag(tagBuffer, tagBufferSize, &event.stats);
+        if (dumpSize > 0) event.dump.assign(tagBuffer, tagBuffer + dumpSize);
+      }
+
+      tagEvents.push(std::move(event));
+    }
+  }
+
+  device.close();
+  return 0;
+}
+
+void printEvent(const TagEvent &event) {
+  const TagPresenceEvent &presence = event.presence;
+  double milliseconds = (presence.nanoseconds - startedAt) / 1000000.0;
+
+  if (presence.type == TagPresenceEvent::Departed) {
+    printf("[%s] %.3f ms: departed after %.1f ms: ", event.port, milliseconds, presence.presentNanoseconds / 1000000.0);
+    PN532::printHex(presence.target.id, presence.target.idLength);
+    return;
+  }
+
+  printf("[%s] %.3f ms: arrived: ", event.port, milliseconds);
+  PN532::printHex(presence.target.id, presence.target.idLength);
+
+  if (event.dump.empty()) {
+    printf("[%s] Dump failed\n", event.port);
+    return;
+  }
+
+  printf("[%s] Dump:\n", event.port);
+  PN532::printHex(event.dump.data(), event.dump.size());
+  printf("[%s] Read %d pages in %d exchanges, %.2f ms\n", event.port, event.stats.pageCount, event.stats.exchanges, event.stats.elapsedNanoseconds / 1000000.0);
 }
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  const char *capturePath = NULL;
+  int maxBaudRate = 0;
+  int option;
+  while ((option = getopt(argc, argv, "c:b:")) != -1) {
+    switch (option) {
+    case 'c': // Record all PN532 traffic to a binary capture (decode with capturedump)
+      capturePath = optarg;
+      break;
+
+    case 'b': // Fastest serial baud rate to try, e.g. 1288000
+      maxBaudRate = atoi(optarg);
+      break;
+
+    default:
+      printf("Usage: %s [-c capture file] [-b max baud rate] <port> [port...]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  if (optind >= argc) {
     printf("Please specify port\n");
     return -1;
   }
 
-  LogLevel = 0xFF;
+  int portCount = argc - optind;
+  if (portCount == 1) LogLevel = 0xFF;
 
-  printf("Initializing NFC adapter\n");
+  for (int i = 0; i < portCount; i++) {
+    Reader *reader = new Reader();
+    reader->port = argv[optind + i];
 
-  device = new PN532(argv[1]);
+    printf("[%s] Initializing NFC adapter\n", reader->port);
+    reader->device = new PN532(reader->port);
 
-  if (device->wakeUp() < 0) { return -1; };
-  if (device->setUp(PN532::InitiatorMode) < 0) { return -1; };
+    // One capture file per port, named <capture file>.<index>, when reading more than one
+    if (capturePath) {
+      char path[1024];
+      if (portCount == 1) snprintf(path, sizeof(path), "%s", capturePath);
+      else snprintf(path, sizeof(path), "%s.%d", capturePath, i);
+
+      if (reader->capture.open(path) < 0) return -1;
+      reader->device->setCapture(&reader->capture);
+    }
+
+    if (reader->device->fastStart(PN532::InitiatorMode) < 0) return -1;
+    if (maxBaudRate && reader->device->negotiateBaudRate(maxBaudRate) < 0) return -1;
+
+    readers.push_back(reader);
+  }
 
   signal(SIGINT, signalHandler);
+  startedAt = monotonicNanoseconds();
+
+  // Each reader polls and dumps on its own thread, so readers never wait on each other
+  std::vector<std::future<int>> finished;
+  for (size_t i = 0; i < readers.size(); i++) {
+    readers[i]->async = new PN532AsyncDevice(readers[i]->device);
+    const char *port = readers[i]->port;
+    finished.push_back(readers[i]->async->run([port](PN532 &device) { return readTags(device, port); }));
+  }
 
   while (!shouldQuit) {
-    const int idLength = 7;
-    uint8_t idBuffer[idLength];
-    printf("Fetching tag id\n");
+    std::unique_lock<std::mutex> lock(tagEvents.mutex);
+    tagEvents.wake.wait_for(lock, std::chrono::milliseconds(100), [] { return !tagEvents.events.empty(); });
 
-    int receivedIdLength = 0;
+    while (!tagEvents.events.empty()) {
+      TagEvent event = std::move(tagEvents.events.front());
+      tagEvents.events.pop_front();
 
-    while (!receivedIdLength && !shouldQuit) {
-      receivedIdLength = device->readTagId(idBuffer, idLength, PN532::TypeABaudRate);
-      sleep(1);
+      lock.unlock();
+      printEvent(event);
+      lock.lock();
     }
+  }
 
-    printf("Received id: ");
-    device->printHex(idBuffer, receivedIdLength);
+  printf("Quitting\n");
 
-    // TODO: Something in nfc-poll is important for SAMConfig to work
-    printf("Fetching page\n");
-    const int pageSize = 16;
-    uint8_t pageBuffer[pageSize];
-    device->ntag2xxReadPage(1, pageBuffer);
-    device->printHex(pageBuffer, 16);
+  for (size_t i = 0; i < readers.size(); i++) {
+    finished[i].wait();
+    delete readers[i]->async;
+    delete readers[i]->device;
+    delete readers[i];
   }
 
-  delete device;
-
   return 0;
 }
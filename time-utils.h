@@ -0,0 +1,14 @@
+#ifndef TIME_UTILS_H
+#define TIME_UTILS_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Nanoseconds from a clock that is never adjusted, for deadlines and intervals
+inline uint64_t monotonicNanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+#endif